@@ -0,0 +1,107 @@
+// Compares smtp_base64_encode() against the OpenSSL BIO_f_base64 chain the
+// library used to allocate for every call.
+//
+//   gcc -O2 -o base64_bench bench/base64_bench.c smtp.c -lssl -lcrypto
+//   ./base64_bench
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/bio.h>
+#include <openssl/evp.h>
+#include <openssl/buffer.h>
+#include "../smtp.h"
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t bio_encode(char *dest, const unsigned char *src, size_t srcLength)
+{
+    BIO *bio, *b64;
+    BUF_MEM *bufferPtr;
+    size_t length;
+
+    b64 = BIO_new(BIO_f_base64());
+    bio = BIO_new(BIO_s_mem());
+    bio = BIO_push(b64, bio);
+
+    BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
+    BIO_write(bio, src, srcLength);
+    BIO_flush(bio);
+
+    BIO_get_mem_ptr(bio, &bufferPtr);
+    memcpy(dest, bufferPtr->data, bufferPtr->length);
+    length = bufferPtr->length;
+
+    BIO_free_all(bio);
+    return length;
+}
+
+static size_t library_encode(char *dest, const unsigned char *src, size_t srcLength)
+{
+    return smtp_base64_encode(dest, src, srcLength, 0);
+}
+
+static size_t library_encode_wrapped(char *dest, const unsigned char *src, size_t srcLength)
+{
+    return smtp_base64_encode(dest, src, srcLength, 1);
+}
+
+static double measure(size_t (*encode)(char *, const unsigned char *, size_t),
+                      char *dest, const unsigned char *src, size_t srcLength)
+{
+    // Repeat until roughly 1 GiB of input went through the encoder
+    size_t iterations = (1UL << 30) / srcLength;
+    if (iterations == 0)
+        iterations = 1;
+
+    double start = now_seconds();
+    for (size_t i = 0; i < iterations; i++)
+        encode(dest, src, srcLength);
+    double elapsed = now_seconds() - start;
+
+    return (double)srcLength * iterations / elapsed / (1024 * 1024);
+}
+
+int main(void)
+{
+    const size_t sizes[] = {1024, 1024 * 1024, 100 * 1024 * 1024};
+    const char *labels[] = {"1 KB", "1 MB", "100 MB"};
+
+    unsigned char *src = malloc(sizes[2]);
+    char *dest = malloc(smtp_base64_encoded_length(sizes[2], 1));
+    char *check = malloc(smtp_base64_encoded_length(sizes[2], 0));
+
+    srand(1);
+    for (size_t i = 0; i < sizes[2]; i++)
+        src[i] = rand();
+
+    printf("%-8s %14s %14s %14s\n", "input", "BIO MB/s", "simd MB/s", "simd+wrap MB/s");
+
+    for (int i = 0; i < 3; i++) {
+        size_t length = sizes[i];
+
+        size_t expected = bio_encode(check, src, length);
+        if (library_encode(dest, src, length) != expected || memcmp(dest, check, expected)) {
+            printf("%-8s output differs from OpenSSL\n", labels[i]);
+            return 1;
+        }
+
+        double bio = measure(bio_encode, dest, src, length);
+        double simd = measure(library_encode, dest, src, length);
+        double wrapped = measure(library_encode_wrapped, dest, src, length);
+
+        printf("%-8s %14.0f %14.0f %14.0f\n", labels[i], bio, simd, wrapped);
+    }
+
+    free(check);
+    free(dest);
+    free(src);
+    return 0;
+}
@@ -0,0 +1,686 @@
+// End-to-end throughput of the library against a local SMTP sink. The sink
+// runs in a child process on 127.0.0.1 and speaks plain SMTP and STARTTLS on
+// port 2525 and implicit TLS on port 465, with a self-signed certificate made
+// at startup; it reads every message to the end and throws it away. Each
+// scenario then runs in a process of its own so its peak RSS is its own.
+//
+//   gcc -O2 -o smtp_bench bench/smtp_bench.c smtp.c -lssl -lcrypto -lpthread
+//   ./smtp_bench [scenario|all] [plain|starttls|tls|all] [scale]
+//
+// scale multiplies the number of messages (0.1 for a quick run). Binding port
+// 465 needs root or CAP_NET_BIND_SERVICE; without it the tls runs are skipped.
+// CPU s/GB is the user and system time of the sending process per gigabyte of
+// message content; the -sendfile scenario repeats the one before it with
+// smtp_attachment_sendfile_configure() on.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+#include "../smtp.h"
+
+#define SINK_BUFFER_SIZE 65536
+
+typedef struct SinkCounters SinkCounters;
+struct SinkCounters
+{
+    unsigned long messages;
+    unsigned long bytes;        // message content, without the commands around it
+};
+
+typedef struct SinkConnection SinkConnection;
+struct SinkConnection
+{
+    int fd;
+    SSL *ssl;
+    char buffer[SINK_BUFFER_SIZE];
+    size_t start;
+    size_t length;
+};
+
+typedef struct Scenario Scenario;
+struct Scenario
+{
+    const char *name;
+    int messages;
+    int senders;            // threads, one session each
+    int attachments;
+    size_t attachmentSize;
+    int sendfile;           // attachments sent from encoded files
+};
+
+typedef struct Result Result;
+struct Result
+{
+    int sent;
+    int failed;
+    double seconds;
+    double p50;
+    double p99;
+    unsigned long bytes;
+    double cpuSeconds;
+    long maxRssKb;
+};
+
+static const Scenario scenarios[] = {
+    { "tiny", 2000, 1, 0, 0, 0 },
+    { "attachment-10mb", 20, 1, 1, 10 << 20, 0 },
+    { "attachment-10mb-sendfile", 20, 1, 1, 10 << 20, 1 },
+    { "many-attachments", 50, 1, 100, 4096, 0 },
+    { "concurrent", 2000, 16, 0, 0, 0 },
+};
+
+static const char *transports[] = { "plain", "starttls", "tls" };
+
+static SinkCounters *counters;     // shared with the sink process
+static SSL_CTX *sinkContext;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long sink_recv(SinkConnection *conn, void *buffer, size_t length)
+{
+    if (conn->ssl)
+    {
+        int n = SSL_read(conn->ssl, buffer, length);
+        return n > 0 ? n : -1;
+    }
+
+    long n = recv(conn->fd, buffer, length, 0);
+    return n > 0 ? n : -1;
+}
+
+static int sink_send(SinkConnection *conn, const char *reply)
+{
+    size_t length = strlen(reply);
+
+    if (conn->ssl)
+        return SSL_write(conn->ssl, reply, length) == (int)length ? 0 : -1;
+
+    return send(conn->fd, reply, length, MSG_NOSIGNAL) == (long)length ? 0 : -1;
+}
+
+static int sink_fill(SinkConnection *conn)
+{
+    if (conn->start)
+    {
+        memmove(conn->buffer, conn->buffer + conn->start, conn->length);
+        conn->start = 0;
+    }
+
+    if (conn->length == SINK_BUFFER_SIZE)
+        return -1;
+
+    long n = sink_recv(conn, conn->buffer + conn->length, SINK_BUFFER_SIZE - conn->length);
+    if (n < 0)
+        return -1;
+
+    conn->length += n;
+    return 0;
+}
+
+// Returns the next line without its CRLF, NUL-terminated in place
+static char* sink_line(SinkConnection *conn, size_t *lineLength)
+{
+    for (;;)
+    {
+        char *line = conn->buffer + conn->start;
+        char *end = conn->length ? memchr(line, '\n', conn->length) : NULL;
+
+        if (end)
+        {
+            size_t consumed = end - line + 1;
+
+            *lineLength = consumed > 1 && end[-1] == '\r' ? consumed - 2 : consumed - 1;
+            line[*lineLength] = '\0';
+            conn->start += consumed;
+            conn->length -= consumed;
+            return line;
+        }
+
+        if (sink_fill(conn))
+            return NULL;
+    }
+}
+
+static int sink_skip(SinkConnection *conn, size_t length)
+{
+    while (length)
+    {
+        if (!conn->length && sink_fill(conn))
+            return -1;
+
+        size_t take = conn->length < length ? conn->length : length;
+
+        conn->start += take;
+        conn->length -= take;
+        length -= take;
+    }
+
+    return 0;
+}
+
+static void sink_count(unsigned long bytes, int messages)
+{
+    __atomic_fetch_add(&counters->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counters->messages, messages, __ATOMIC_RELAXED);
+}
+
+static void* sink_session(void *arg)
+{
+    SinkConnection *conn = arg;
+    int implicit = conn->ssl != NULL;
+    unsigned long bdatBytes = 0;
+    char *line;
+    size_t length;
+
+    if (implicit && SSL_accept(conn->ssl) != 1)
+        goto done;
+
+    if (sink_send(conn, "220 sink ESMTP\r\n"))
+        goto done;
+
+    while ((line = sink_line(conn, &length)))
+    {
+        const char *reply = "250 ok\r\n";
+
+        if (strncasecmp(line, "EHLO", 4) == 0)
+            reply = conn->ssl
+                ? "250-sink\r\n250-PIPELINING\r\n250-AUTH LOGIN XOAUTH2\r\n250-8BITMIME\r\n250-SIZE 0\r\n250 CHUNKING\r\n"
+                : "250-sink\r\n250-PIPELINING\r\n250-STARTTLS\r\n250-AUTH LOGIN XOAUTH2\r\n250-8BITMIME\r\n250-SIZE 0\r\n250 CHUNKING\r\n";
+        else if (strncasecmp(line, "STARTTLS", 8) == 0)
+        {
+            if (sink_send(conn, "220 go ahead\r\n"))
+                break;
+
+            conn->ssl = SSL_new(sinkContext);
+            SSL_set_fd(conn->ssl, conn->fd);
+            conn->start = conn->length = 0;
+
+            if (SSL_accept(conn->ssl) != 1)
+                break;
+
+            continue;
+        }
+        else if (strncasecmp(line, "AUTH LOGIN", 10) == 0)
+        {
+            if (sink_send(conn, "334 VXNlcm5hbWU6\r\n") || !sink_line(conn, &length)
+                || sink_send(conn, "334 UGFzc3dvcmQ6\r\n") || !sink_line(conn, &length))
+                break;
+
+            reply = "235 authenticated\r\n";
+        }
+        else if (strncasecmp(line, "AUTH", 4) == 0)
+            reply = "235 authenticated\r\n";
+        else if (strncasecmp(line, "DATA", 4) == 0)
+        {
+            unsigned long bytes = 0;
+
+            if (sink_send(conn, "354 go ahead\r\n"))
+                break;
+
+            while ((line = sink_line(conn, &length)) && strcmp(line, ".") != 0)
+                bytes += length + 2;
+
+            if (!line)
+                break;
+
+            sink_count(bytes, 1);
+            reply = "250 queued\r\n";
+        }
+        else if (strncasecmp(line, "BDAT", 4) == 0)
+        {
+            char *end;
+            unsigned long chunk = strtoul(line + 5, &end, 10);
+            int last = strncasecmp(end, " LAST", 5) == 0;
+
+            if (sink_skip(conn, chunk))
+                break;
+
+            bdatBytes += chunk;
+
+            if (last)
+            {
+                sink_count(bdatBytes, 1);
+                bdatBytes = 0;
+                reply = "250 queued\r\n";
+            }
+        }
+        else if (strncasecmp(line, "QUIT", 4) == 0)
+        {
+            sink_send(conn, "221 bye\r\n");
+            break;
+        }
+
+        if (sink_send(conn, reply))
+            break;
+    }
+
+done:
+    if (conn->ssl)
+        SSL_free(conn->ssl);
+
+    close(conn->fd);
+    free(conn);
+    return NULL;
+}
+
+static int sink_listen(int port)
+{
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(port) };
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) || listen(fd, 512))
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+typedef struct SinkListener SinkListener;
+struct SinkListener
+{
+    int fd;
+    int implicit;       // TLS from the first byte rather than after STARTTLS
+};
+
+static void* sink_accept(void *arg)
+{
+    SinkListener *listener = arg;
+
+    for (;;)
+    {
+        int client = accept(listener->fd, NULL, NULL);
+        if (client < 0)
+            continue;
+
+        SinkConnection *conn = calloc(1, sizeof(SinkConnection));
+        pthread_t thread;
+        int one = 1;
+
+        // Replies to pipelined commands go out one by one as they are made
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        conn->fd = client;
+        if (listener->implicit)
+        {
+            conn->ssl = SSL_new(sinkContext);
+            SSL_set_fd(conn->ssl, client);
+        }
+
+        pthread_create(&thread, NULL, sink_session, conn);
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+static SSL_CTX* sink_tls_context(void)
+{
+    SSL_CTX *context = SSL_CTX_new(TLS_server_method());
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *certificate = X509_new();
+    X509_NAME *name = X509_get_subject_name(certificate);
+
+    ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+    X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+    X509_gmtime_adj(X509_getm_notAfter(certificate), 86400);
+    X509_set_pubkey(certificate, key);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"localhost", -1, -1, 0);
+    X509_set_issuer_name(certificate, name);
+    X509_sign(certificate, key, EVP_sha256());
+
+    SSL_CTX_use_certificate(context, certificate);
+    SSL_CTX_use_PrivateKey(context, key);
+    X509_free(certificate);
+    EVP_PKEY_free(key);
+    return context;
+}
+
+// Starts the sink and returns its pid. *tlsAvailable tells whether port 465
+// could be bound.
+static pid_t sink_start(int *tlsAvailable)
+{
+    int ready[2];
+    char status = 0;
+
+    if (pipe(ready))
+        return -1;
+
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        static SinkListener plain, implicit;
+        pthread_t thread;
+
+        plain.fd = sink_listen(2525);
+        implicit.fd = sink_listen(465);
+        implicit.implicit = 1;
+
+        signal(SIGPIPE, SIG_IGN);
+        sinkContext = sink_tls_context();
+
+        status = (plain.fd >= 0) | (implicit.fd >= 0) << 1;
+        if (write(ready[1], &status, 1) != 1 || plain.fd < 0)
+            _exit(1);
+
+        if (implicit.fd >= 0)
+        {
+            pthread_create(&thread, NULL, sink_accept, &implicit);
+            pthread_detach(thread);
+        }
+
+        sink_accept(&plain);
+        _exit(0);
+    }
+
+    close(ready[1]);
+
+    if (pid < 0 || read(ready[0], &status, 1) != 1 || !(status & 1))
+    {
+        fprintf(stderr, "the sink cannot listen on 127.0.0.1:2525\n");
+        close(ready[0]);
+        return -1;
+    }
+
+    close(ready[0]);
+    *tlsAvailable = status >> 1;
+    return pid;
+}
+
+typedef struct Sender Sender;
+struct Sender
+{
+    SMTPClient client;
+    MailMessage *message;
+    int messages;
+    double *latencies;
+    int sent;
+    int failed;
+};
+
+static void* sender_run(void *arg)
+{
+    Sender *sender = arg;
+    SMTPSession *session = smtp_session_open(sender->client, 0);
+
+    for (int i = 0; i < sender->messages; i++)
+    {
+        double start = now_seconds();
+
+        if (session && smtp_session_send(session, sender->message) == 0)
+            sender->latencies[sender->sent++] = now_seconds() - start;
+        else
+            sender->failed++;
+    }
+
+    if (session)
+        smtp_session_close(session);
+
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Writes the attachment files a scenario needs into directory
+static int make_attachments(MailMessage *message, const Scenario *scenario, const char *directory)
+{
+    if (!scenario->attachments)
+        return 0;
+
+    char *data = malloc(scenario->attachmentSize);
+
+    if (!data)
+        return -1;
+
+    for (size_t i = 0; i < scenario->attachmentSize; i++)
+        data[i] = (char)(rand() & 0xff);
+
+    for (int i = 0; i < scenario->attachments; i++)
+    {
+        char path[512], name[64];
+
+        snprintf(name, sizeof(name), "file%d.bin", i);
+        snprintf(path, sizeof(path), "%s/%s", directory, name);
+
+        FILE *file = fopen(path, "wb");
+        if (!file || fwrite(data, 1, scenario->attachmentSize, file) != scenario->attachmentSize)
+        {
+            if (file)
+                fclose(file);
+
+            free(data);
+            return -1;
+        }
+
+        fclose(file);
+        smtp_message_add_attachment(message, name, path);
+    }
+
+    free(data);
+    return 0;
+}
+
+static void remove_attachments(const Scenario *scenario, const char *directory)
+{
+    char path[512];
+
+    for (int i = 0; i < scenario->attachments; i++)
+    {
+        snprintf(path, sizeof(path), "%s/file%d.bin", directory, i);
+        unlink(path);
+    }
+
+    rmdir(directory);
+}
+
+static void run_scenario(const Scenario *scenario, int transport, double scale, Result *result)
+{
+    SMTPClient client = {
+        .mailServer = "127.0.0.1",
+        .emailAdress = "bench@localhost",
+        .secretCode = "secret",
+        .enableSSL = transport != 0,
+        .port = transport == 2 ? 465 : 2525,
+        .authType = LOGIN
+    };
+    char directory[] = "/tmp/smtp_bench_XXXXXX";
+    int messages = scenario->messages * scale;
+    MailMessage *message = smtp_message_create();
+
+    if (messages < scenario->senders)
+        messages = scenario->senders;
+
+    static const char body[] = "A short text message of the kind sent by the thousand.\n";
+
+    smtp_message_add_recipient(message, "sink@localhost", RECIPIENT_TO);
+    smtp_message_set_subject(message, scenario->name);
+    smtp_message_set_body(message, body, sizeof(body) - 1, 0);
+
+    if (!mkdtemp(directory) || make_attachments(message, scenario, directory))
+    {
+        result->failed = messages;
+        return;
+    }
+
+    if (scenario->sendfile && smtp_attachment_sendfile_configure(directory, 1UL << 30))
+    {
+        remove_attachments(scenario, directory);
+        result->failed = messages;
+        return;
+    }
+
+    Sender *senders = calloc(scenario->senders, sizeof(Sender));
+    pthread_t *threads = calloc(scenario->senders, sizeof(pthread_t));
+    double *latencies = calloc(messages, sizeof(double));
+    double *next = latencies;
+
+    for (int i = 0; i < scenario->senders; i++)
+    {
+        senders[i].client = client;
+        senders[i].message = message;
+        senders[i].messages = messages / scenario->senders + (i < messages % scenario->senders);
+        senders[i].latencies = next;
+        next += senders[i].messages;
+    }
+
+    unsigned long bytes = __atomic_load_n(&counters->bytes, __ATOMIC_RELAXED);
+    double start = now_seconds();
+
+    for (int i = 0; i < scenario->senders; i++)
+        pthread_create(&threads[i], NULL, sender_run, &senders[i]);
+
+    for (int i = 0; i < scenario->senders; i++)
+        pthread_join(threads[i], NULL);
+
+    result->seconds = now_seconds() - start;
+    result->bytes = __atomic_load_n(&counters->bytes, __ATOMIC_RELAXED) - bytes;
+
+    // Latencies of all senders, packed together
+    int count = 0;
+    for (int i = 0; i < scenario->senders; i++)
+    {
+        memmove(latencies + count, senders[i].latencies, senders[i].sent * sizeof(double));
+        count += senders[i].sent;
+        result->failed += senders[i].failed;
+    }
+
+    result->sent = count;
+    qsort(latencies, count, sizeof(double), compare_doubles);
+
+    if (count)
+    {
+        result->p50 = latencies[count / 2];
+        result->p99 = latencies[(count * 99) / 100 < count ? (count * 99) / 100 : count - 1];
+    }
+
+    smtp_attachment_sendfile_configure(NULL, 0);
+    remove_attachments(scenario, directory);
+    smtp_message_free(message);
+    free(latencies);
+    free(threads);
+    free(senders);
+}
+
+int main(int argc, char **argv)
+{
+    const char *scenarioName = argc > 1 ? argv[1] : "all";
+    const char *transportName = argc > 2 ? argv[2] : "all";
+    double scale = argc > 3 ? atof(argv[3]) : 1.0;
+    int tlsAvailable = 0;
+
+    if (scale <= 0)
+        scale = 1.0;
+
+    counters = mmap(NULL, sizeof(SinkCounters), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (counters == MAP_FAILED)
+        return 1;
+
+    pid_t sink = sink_start(&tlsAvailable);
+    if (sink < 0)
+        return 1;
+
+    printf("%-24s %-9s %8s %10s %9s %9s %10s %9s %9s\n",
+           "scenario", "transport", "messages", "msgs/s", "p50 ms", "p99 ms", "MB/s", "CPU s/GB", "RSS MB");
+
+    for (size_t s = 0; s < sizeof(scenarios) / sizeof(Scenario); s++)
+    {
+        if (strcmp(scenarioName, "all") != 0 && strcmp(scenarioName, scenarios[s].name) != 0)
+            continue;
+
+        for (int t = 0; t < 3; t++)
+        {
+            if (strcmp(transportName, "all") != 0 && strcmp(transportName, transports[t]) != 0)
+                continue;
+
+            if (t == 2 && !tlsAvailable)
+            {
+                printf("%-24s %-9s skipped, port 465 could not be bound\n", scenarios[s].name, transports[t]);
+                continue;
+            }
+
+            int channel[2];
+            Result result = {0};
+
+            if (pipe(channel))
+                break;
+
+            fflush(stdout);
+            pid_t pid = fork();
+
+            if (pid == 0)
+            {
+                struct rusage usage;
+
+                close(channel[0]);
+                run_scenario(&scenarios[s], t, scale, &result);
+                getrusage(RUSAGE_SELF, &usage);
+                result.cpuSeconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+                                  + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+                result.maxRssKb = usage.ru_maxrss;
+
+                _exit(write(channel[1], &result, sizeof(result)) != sizeof(result));
+            }
+
+            close(channel[1]);
+
+            if (pid < 0 || read(channel[0], &result, sizeof(result)) != sizeof(result))
+                result.failed = -1;
+
+            close(channel[0]);
+            if (pid > 0)
+                waitpid(pid, NULL, 0);
+
+            if (result.failed < 0 || !result.sent)
+            {
+                printf("%-24s %-9s failed\n", scenarios[s].name, transports[t]);
+                continue;
+            }
+
+            printf("%-24s %-9s %8d %10.1f %9.3f %9.3f %10.1f %9.2f %9.1f",
+                   scenarios[s].name, transports[t], result.sent,
+                   result.sent / result.seconds, result.p50 * 1000, result.p99 * 1000,
+                   result.bytes / result.seconds / (1 << 20), result.cpuSeconds / (result.bytes / 1e9),
+                   result.maxRssKb / 1024.0);
+
+            if (result.failed)
+                printf("  (%d failed)", result.failed);
+
+            printf("\n");
+        }
+    }
+
+    kill(sink, SIGTERM);
+    waitpid(sink, NULL, 0);
+    return 0;
+}
@@ -1,20 +1,546 @@
 #include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#include <math.h>
 #include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
-#include <openssl/bio.h>
-#include <openssl/evp.h>
+#include <openssl/rand.h>
 #include "smtp.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// 57 input bytes make one 76-character base64 line
+#define BASE64_LINE_INPUT 57
+#define ATTACHMENT_BLOCK_LINES 256
+
+// Room for one block of encoded attachment lines
+#define MESSAGE_WRITER_CHUNK (78 * ATTACHMENT_BLOCK_LINES)
+
+// Plaintext bytes in a full TLS record; output is written in multiples of
+// it so every record goes out full
+#define TLS_RECORD_SIZE 16384
+
+// Extensions advertised in the EHLO reply
+#define CAPABILITY_PIPELINING 0x01
+#define CAPABILITY_SIZE 0x02
+#define CAPABILITY_8BITMIME 0x04
+#define CAPABILITY_CHUNKING 0x08
+#define CAPABILITY_SMTPUTF8 0x10
+
+// Most envelope commands written before their replies are read
+#define PIPELINE_WINDOW 64
+
+// BDAT chunks are built in place behind room for their command line and
+// fill four TLS records together with it
+#define BDAT_HEADER_SIZE 32
+#define BDAT_CHUNK_SIZE (4 * TLS_RECORD_SIZE - BDAT_HEADER_SIZE)
+
+typedef struct Capabilities Capabilities;
+struct Capabilities
+{
+    int flags;
+    size_t maxSize;         // from SIZE, 0 when unlimited
+};
+
+// Every heap allocation the library makes goes through these, so the
+// counters show whether a warmed-up send path still allocates
+static unsigned long allocationCount;
+static unsigned long allocationBytes;
+
+static void allocation_count(size_t length)
+{
+    __atomic_fetch_add(&allocationCount, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&allocationBytes, length, __ATOMIC_RELAXED);
+}
+
+static void* smtp_malloc(size_t length)
+{
+    allocation_count(length);
+    return malloc(length);
+}
+
+static void* smtp_calloc(size_t count, size_t size)
+{
+    allocation_count(count * size);
+    return calloc(count, size);
+}
+
+static void* smtp_realloc(void *memory, size_t length)
+{
+    allocation_count(length);
+    return realloc(memory, length);
+}
+
+void smtp_memory_get_stats(SMTPMemoryStats *stats)
+{
+    stats->allocations = __atomic_load_n(&allocationCount, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&allocationBytes, __ATOMIC_RELAXED);
+}
+
+// Per-phase timings in process-wide histograms. Samples are added with
+// relaxed atomics and no lock; while metrics are off a phase costs one load
+// and a branch.
+static int metricsEnabled;
+static SMTPMetricsCallback metricsCallback;
+static void *metricsUserData;
+static SMTPPhaseStats metricsPhases[SMTP_PHASE_COUNT];
+
+static const char *metricsPhaseNames[SMTP_PHASE_COUNT] = {
+    "dns", "connect", "tls", "greeting", "ehlo", "auth", "envelope",
+    "attachment", "encode", "upload", "final_reply"
+};
+
+// Nanoseconds on the monotonic clock, or 0 while metrics are off
+static uint64_t metrics_now(void)
+{
+    struct timespec ts;
+
+    if (!__atomic_load_n(&metricsEnabled, __ATOMIC_RELAXED))
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Adds the time since start, a metrics_now() value, to a phase. Bucket i
+// holds durations up to 2^i microseconds, the last one everything longer.
+static void metrics_record(SMTPPhase phase, uint64_t start, size_t bytes)
+{
+    if (!start)
+        return;
+
+    uint64_t end = metrics_now();
+    if (!end)
+        return;
+
+    uint64_t microseconds = (end - start) / 1000;
+    SMTPPhaseStats *stats = &metricsPhases[phase];
+    int bucket = microseconds <= 1 ? 0 : 64 - __builtin_clzll(microseconds - 1);
+
+    if (bucket >= SMTP_METRICS_BUCKETS)
+        bucket = SMTP_METRICS_BUCKETS - 1;
+
+    __atomic_fetch_add(&stats->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->totalMicroseconds, microseconds, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->buckets[bucket], 1, __ATOMIC_RELAXED);
+
+    SMTPMetricsCallback callback = __atomic_load_n(&metricsCallback, __ATOMIC_ACQUIRE);
+    if (callback)
+        callback(phase, microseconds, bytes, metricsUserData);
+}
+
+void smtp_metrics_enable(int enable)
+{
+    __atomic_store_n(&metricsEnabled, enable, __ATOMIC_RELAXED);
+}
+
+void smtp_metrics_set_callback(SMTPMetricsCallback callback, void *userData)
+{
+    metricsUserData = userData;
+    __atomic_store_n(&metricsCallback, callback, __ATOMIC_RELEASE);
+}
+
+void smtp_metrics_get(SMTPPhase phase, SMTPPhaseStats *stats)
+{
+    SMTPPhaseStats *source = &metricsPhases[phase];
+
+    stats->count = __atomic_load_n(&source->count, __ATOMIC_RELAXED);
+    stats->totalMicroseconds = __atomic_load_n(&source->totalMicroseconds, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&source->bytes, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < SMTP_METRICS_BUCKETS; i++)
+        stats->buckets[i] = __atomic_load_n(&source->buckets[i], __ATOMIC_RELAXED);
+}
+
+void smtp_metrics_reset(void)
+{
+    for (int phase = 0; phase < SMTP_PHASE_COUNT; phase++)
+    {
+        SMTPPhaseStats *stats = &metricsPhases[phase];
+
+        __atomic_store_n(&stats->count, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->totalMicroseconds, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->bytes, 0, __ATOMIC_RELAXED);
+
+        for (int i = 0; i < SMTP_METRICS_BUCKETS; i++)
+            __atomic_store_n(&stats->buckets[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+// Appends to dest like snprintf, remembering the length even past capacity
+static void metrics_append(char *dest, size_t capacity, size_t *length, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    int n = vsnprintf(dest ? dest + (*length < capacity ? *length : capacity) : NULL,
+                      *length < capacity ? capacity - *length : 0, format, args);
+    va_end(args);
+
+    if (n > 0)
+        *length += n;
+}
+
+size_t smtp_metrics_format(char *dest, size_t capacity)
+{
+    size_t length = 0;
+
+    metrics_append(dest, capacity, &length,
+                   "# TYPE smtp_phase_duration_seconds histogram\n");
+
+    for (int phase = 0; phase < SMTP_PHASE_COUNT; phase++)
+    {
+        SMTPPhaseStats stats;
+        unsigned long cumulative = 0;
+
+        smtp_metrics_get(phase, &stats);
+
+        for (int i = 0; i < SMTP_METRICS_BUCKETS - 1; i++)
+        {
+            cumulative += stats.buckets[i];
+            metrics_append(dest, capacity, &length,
+                           "smtp_phase_duration_seconds_bucket{phase=\"%s\",le=\"%g\"} %lu\n",
+                           metricsPhaseNames[phase], (double)(1UL << i) / 1e6, cumulative);
+        }
+
+        metrics_append(dest, capacity, &length,
+                       "smtp_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n"
+                       "smtp_phase_duration_seconds_sum{phase=\"%s\"} %.6f\n"
+                       "smtp_phase_duration_seconds_count{phase=\"%s\"} %lu\n",
+                       metricsPhaseNames[phase], stats.count,
+                       metricsPhaseNames[phase], stats.totalMicroseconds / 1e6,
+                       metricsPhaseNames[phase], stats.count);
+    }
+
+    metrics_append(dest, capacity, &length, "# TYPE smtp_phase_bytes_total counter\n");
+
+    for (int phase = 0; phase < SMTP_PHASE_COUNT; phase++)
+        metrics_append(dest, capacity, &length, "smtp_phase_bytes_total{phase=\"%s\"} %lu\n",
+                       metricsPhaseNames[phase], __atomic_load_n(&metricsPhases[phase].bytes, __ATOMIC_RELAXED));
+
+    return length;
+}
+
+// Log records go through a bounded ring in which every slot carries a
+// sequence number: producers claim slots with a compare-and-swap on the head
+// and publish them by advancing the sequence, and a single drain thread hands
+// them to the handler in order. Only the drain thread ever sleeps.
+#define LOG_RING_SIZE 1024
+#define LOG_TEXT_SIZE 496
+#define LOG_DEFAULT_PAYLOAD 256
+
+typedef struct LogSlot LogSlot;
+struct LogSlot
+{
+    unsigned long sequence;     // index + 1 once published, index + LOG_RING_SIZE once free again
+    SMTPLogLevel level;
+    SMTPLogSource source;
+    long long timeMicroseconds;
+    size_t length;
+    size_t originalLength;
+    char text[LOG_TEXT_SIZE];
+};
+
+static void log_print(const SMTPLogRecord *record, void *userData);
+
+static LogSlot *logRing;
+static unsigned long logHead;
+static unsigned long logTail;
+static int logSleeping;
+static int logLevel = SMTP_LOG_DEBUG;
+static size_t logMaxPayload = LOG_DEFAULT_PAYLOAD;
+static SMTPLogHandler logHandler = log_print;
+static void *logUserData;
+static unsigned long logLogged;
+static unsigned long logDropped;
+static pthread_once_t logOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logWork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t logDrained = PTHREAD_COND_INITIALIZER;
+
+static void log_print(const SMTPLogRecord *record, void *userData)
+{
+    static const char *prefixes[] = { "C: ", "S: ", "Spool: " };
+
+    (void)userData;
+    fputs(prefixes[record->source], stdout);
+    fwrite(record->text, 1, record->length, stdout);
+
+    if (record->originalLength > record->length)
+        printf("[... %zu more bytes]\n", record->originalLength - record->length);
+}
+
+static void* log_drain(void *unused)
+{
+    (void)unused;
+
+    for (;;)
+    {
+        unsigned long tail = logTail;
+        LogSlot *slot = &logRing[tail % LOG_RING_SIZE];
+
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != tail + 1)
+        {
+            // Producers only signal once they see logSleeping, so it is set
+            // before the ring is looked at again; the timeout covers a
+            // producer that claimed a slot but has not published it yet
+            struct timespec deadline;
+
+            pthread_mutex_lock(&logLock);
+            pthread_cond_broadcast(&logDrained);
+            __atomic_store_n(&logSleeping, 1, __ATOMIC_SEQ_CST);
+
+            if (__atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST) != tail + 1)
+            {
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += 100000000;
+                if (deadline.tv_nsec >= 1000000000)
+                {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000;
+                }
+
+                pthread_cond_timedwait(&logWork, &logLock, &deadline);
+            }
+
+            __atomic_store_n(&logSleeping, 0, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&logLock);
+            continue;
+        }
+
+        SMTPLogRecord record = {
+            slot->level, slot->source, slot->timeMicroseconds,
+            slot->text, slot->length, slot->originalLength
+        };
+
+        pthread_mutex_lock(&logLock);
+        SMTPLogHandler handler = logHandler;
+        void *userData = logUserData;
+        pthread_mutex_unlock(&logLock);
+
+        handler(&record, userData);
+
+        __atomic_store_n(&slot->sequence, tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        __atomic_store_n(&logTail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+static void log_start(void)
+{
+    pthread_t thread;
+    LogSlot *ring = smtp_calloc(LOG_RING_SIZE, sizeof(LogSlot));
+
+    if (!ring)
+        return;
+
+    for (unsigned long i = 0; i < LOG_RING_SIZE; i++)
+        ring[i].sequence = i;
+
+    logRing = ring;
+
+    if (pthread_create(&thread, NULL, log_drain, NULL))
+    {
+        logRing = NULL;
+        free(ring);
+        return;
+    }
+
+    pthread_detach(thread);
+    atexit(smtp_log_flush);
+}
+
+static void log_write(SMTPLogLevel level, SMTPLogSource source, const char *text, size_t length)
+{
+    if ((int)level > __atomic_load_n(&logLevel, __ATOMIC_RELAXED))
+        return;
+
+    pthread_once(&logOnce, log_start);
+
+    if (!logRing)
+    {
+        __atomic_fetch_add(&logDropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    unsigned long position = __atomic_load_n(&logHead, __ATOMIC_RELAXED);
+    LogSlot *slot;
+
+    for (;;)
+    {
+        slot = &logRing[position % LOG_RING_SIZE];
+        long difference = (long)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - position);
+
+        if (difference == 0)
+        {
+            if (__atomic_compare_exchange_n(&logHead, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (difference < 0)
+        {
+            // Still held by the drain thread from the last lap: the ring is full
+            __atomic_fetch_add(&logDropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else
+            position = __atomic_load_n(&logHead, __ATOMIC_RELAXED);
+    }
+
+    struct timespec ts;
+    size_t limit = __atomic_load_n(&logMaxPayload, __ATOMIC_RELAXED);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    slot->level = level;
+    slot->source = source;
+    slot->timeMicroseconds = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    slot->originalLength = length;
+    slot->length = length < limit ? length : limit;
+    memcpy(slot->text, text, slot->length);
+    slot->text[slot->length] = 0;
+
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&logLogged, 1, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&logSleeping, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&logLock);
+        pthread_cond_signal(&logWork);
+        pthread_mutex_unlock(&logLock);
+    }
+}
+
+static void log_format(SMTPLogLevel level, SMTPLogSource source, const char *format, ...)
+{
+    char text[LOG_TEXT_SIZE];
+    va_list args;
+
+    va_start(args, format);
+    int length = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+
+    if (length > 0)
+        log_write(level, source, text, (size_t)length < sizeof(text) ? (size_t)length : sizeof(text) - 1);
+}
+
+// Protocol traffic. An AUTH command keeps its mechanism and loses its
+// initial response; secret lines (the AUTH LOGIN user name and password) are
+// not logged at all.
+static void log_protocol(SMTPLogSource source, const char *data, size_t length, int secret)
+{
+    static const char redacted[] = "[redacted]\r\n";
+
+    if (secret)
+    {
+        log_write(SMTP_LOG_DEBUG, source, redacted, sizeof(redacted) - 1);
+        return;
+    }
+
+    if (source == SMTP_LOG_CLIENT && length > 5 && memcmp(data, "AUTH ", 5) == 0)
+    {
+        const char *space = memchr(data + 5, ' ', length - 5);
+
+        if (space)
+        {
+            log_format(SMTP_LOG_DEBUG, source, "%.*s %s", (int)(space - data), data, redacted);
+            return;
+        }
+    }
+
+    log_write(SMTP_LOG_DEBUG, source, data, length);
+}
+
+void smtp_log_configure(SMTPLogLevel level, size_t maxPayload, SMTPLogHandler handler, void *userData)
+{
+    if (!maxPayload)
+        maxPayload = LOG_DEFAULT_PAYLOAD;
+
+    if (maxPayload > LOG_TEXT_SIZE - 1)
+        maxPayload = LOG_TEXT_SIZE - 1;
+
+    pthread_mutex_lock(&logLock);
+    logHandler = handler ? handler : log_print;
+    logUserData = userData;
+    pthread_mutex_unlock(&logLock);
+
+    __atomic_store_n(&logMaxPayload, maxPayload, __ATOMIC_RELAXED);
+    __atomic_store_n(&logLevel, level, __ATOMIC_RELAXED);
+}
+
+void smtp_log_flush(void)
+{
+    if (!__atomic_load_n(&logRing, __ATOMIC_ACQUIRE))
+        return;
+
+    unsigned long target = __atomic_load_n(&logHead, __ATOMIC_ACQUIRE);
+    unsigned long seen = __atomic_load_n(&logTail, __ATOMIC_ACQUIRE);
+    int idle = 0;
+
+    // Gives up after a second without progress, as in a forked child where
+    // the drain thread no longer exists
+    pthread_mutex_lock(&logLock);
+
+    while (idle < 10)
+    {
+        unsigned long tail = __atomic_load_n(&logTail, __ATOMIC_ACQUIRE);
+        struct timespec deadline;
+
+        if ((long)(tail - target) >= 0)
+            break;
+
+        idle = tail == seen ? idle + 1 : 0;
+        seen = tail;
+
+        pthread_cond_signal(&logWork);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        pthread_cond_timedwait(&logDrained, &logLock, &deadline);
+    }
+
+    pthread_mutex_unlock(&logLock);
+    fflush(stdout);
+}
+
+void smtp_log_get_stats(SMTPLogStats *stats)
+{
+    stats->logged = __atomic_load_n(&logLogged, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&logDropped, __ATOMIC_RELAXED);
+}
+
 typedef struct {
     const char *extension;
     const char *mime_type;
@@ -120,846 +646,6773 @@ static const MimeMapping mime_types[] = {
     {NULL, "application/octet-stream"}
 };
 
+#define MIME_TYPE_COUNT (sizeof(mime_types) / sizeof(MimeMapping) - 1)
+#define MIME_EXTENSION_MAX 32
+
+// The table sorted by extension, built once, so a lookup is a binary search
+// over lower-cased extensions
+static pthread_once_t mimeOnce = PTHREAD_ONCE_INIT;
+static MimeMapping mimeSorted[MIME_TYPE_COUNT];
+
+// Mappings added at runtime, kept sorted and looked at first. Their strings
+// are never freed, so a returned type stays valid while another is added.
+static pthread_mutex_t mimeLock = PTHREAD_MUTEX_INITIALIZER;
+static MimeMapping *mimeCustom;
+static int mimeCustomCount;
+static int mimeCustomCapacity;
+static int mimeSniffing;
+
+static int mime_compare(const void *a, const void *b)
+{
+    return strcmp(((const MimeMapping*)a)->extension, ((const MimeMapping*)b)->extension);
+}
+
+static void mime_init(void)
+{
+    memcpy(mimeSorted, mime_types, sizeof(mimeSorted));
+    qsort(mimeSorted, MIME_TYPE_COUNT, sizeof(MimeMapping), mime_compare);
+}
+
+// Copies the extension of a file name, dot included, in lower case. Returns
+// 0 when there is none or it is too long to be in any table.
+static int mime_extension(char *dest, const char *name)
+{
+    const char *extension = strrchr(name, '.');
+    size_t length;
+
+    if (!extension || (length = strlen(extension)) >= MIME_EXTENSION_MAX)
+        return 0;
+
+    for (size_t i = 0; i <= length; i++)
+        dest[i] = extension[i] >= 'A' && extension[i] <= 'Z' ? extension[i] + ('a' - 'A') : extension[i];
+
+    return 1;
+}
+
+// Returns the position of the extension in a sorted table, or where it would
+// go when *found is 0
+static int mime_search(const MimeMapping *mappings, int count, const char *extension, int *found)
+{
+    int low = 0, high = count;
+
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+
+        if (strcmp(mappings[middle].extension, extension) < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    *found = low < count && strcmp(mappings[low].extension, extension) == 0;
+    return low;
+}
+
 static const char *get_mime_type(const char *filename) {
-    const char *extension = strrchr(filename, '.');
-    if (!extension) {
-        return mime_types[sizeof(mime_types)/sizeof(MimeMapping) - 1].mime_type;
+    char extension[MIME_EXTENSION_MAX];
+    const char *type = NULL;
+    int found;
+
+    if (!mime_extension(extension, filename)) {
+        return mime_types[MIME_TYPE_COUNT].mime_type;
+    }
+
+    if (__atomic_load_n(&mimeCustomCount, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&mimeLock);
+
+        int index = mime_search(mimeCustom, mimeCustomCount, extension, &found);
+        if (found)
+            type = mimeCustom[index].mime_type;
+
+        pthread_mutex_unlock(&mimeLock);
+
+        if (type)
+            return type;
     }
 
-    // Case-insensitive comparison
-    for (int i = 0; mime_types[i].extension; i++) {
-        if (strcasecmp(extension, mime_types[i].extension) == 0) {
-            return mime_types[i].mime_type;
+    pthread_once(&mimeOnce, mime_init);
+
+    int index = mime_search(mimeSorted, MIME_TYPE_COUNT, extension, &found);
+    if (found) {
+        return mimeSorted[index].mime_type;
+    }
+
+    return mime_types[MIME_TYPE_COUNT].mime_type;
+}
+
+int smtp_mime_type_register(const char *extension, const char *mimeType)
+{
+    char key[MIME_EXTENSION_MAX];
+    int found;
+
+    // Taken with or without the leading dot
+    if (extension[0] == '.')
+        extension++;
+
+    size_t extensionLength = strlen(extension);
+
+    if (extensionLength == 0 || extensionLength >= MIME_EXTENSION_MAX - 1 || strchr(extension, '.'))
+        return -1;
+
+    key[0] = '.';
+    strcpy(key + 1, extension);
+    mime_extension(key, key);
+
+    size_t typeLength = strlen(mimeType) + 1;
+
+    char *strings = smtp_malloc(extensionLength + 2 + typeLength);
+    if (!strings)
+        return -1;
+
+    memcpy(strings, key, extensionLength + 2);
+    memcpy(strings + extensionLength + 2, mimeType, typeLength);
+
+    pthread_mutex_lock(&mimeLock);
+
+    int index = mime_search(mimeCustom, mimeCustomCount, key, &found);
+
+    if (!found && mimeCustomCount == mimeCustomCapacity)
+    {
+        int capacity = mimeCustomCapacity ? mimeCustomCapacity * 2 : 16;
+        MimeMapping *mappings = smtp_realloc(mimeCustom, capacity * sizeof(MimeMapping));
+
+        if (!mappings)
+        {
+            pthread_mutex_unlock(&mimeLock);
+            free(strings);
+            return -1;
         }
+
+        mimeCustom = mappings;
+        mimeCustomCapacity = capacity;
     }
 
-    return mime_types[sizeof(mime_types)/sizeof(MimeMapping) - 1].mime_type;
+    if (!found)
+    {
+        memmove(&mimeCustom[index + 1], &mimeCustom[index], (mimeCustomCount - index) * sizeof(MimeMapping));
+        __atomic_store_n(&mimeCustomCount, mimeCustomCount + 1, __ATOMIC_RELEASE);
+    }
+
+    mimeCustom[index].extension = strings;
+    mimeCustom[index].mime_type = strings + extensionLength + 2;
+
+    pthread_mutex_unlock(&mimeLock);
+    return 0;
 }
 
-unsigned char* read_file(const char* path, size_t* length) {
-    FILE* file = fopen(path, "rb");
-    if (!file) return NULL;
+void smtp_mime_sniffing_configure(int enable)
+{
+    __atomic_store_n(&mimeSniffing, enable, __ATOMIC_RELAXED);
+}
+
+// Signatures of common binary formats. Only types that are sent base64-encoded
+// anyway are recognised, so sniffing never changes how a file is encoded.
+typedef struct {
+    size_t offset;
+    size_t length;
+    const char *magic;
+    const char *mime_type;
+} MimeSignature;
+
+static const MimeSignature mime_signatures[] = {
+    {0, 5, "%PDF-", "application/pdf"},
+    {0, 8, "\x89PNG\r\n\x1a\n", "image/png"},
+    {0, 3, "\xff\xd8\xff", "image/jpeg"},
+    {0, 6, "GIF87a", "image/gif"},
+    {0, 6, "GIF89a", "image/gif"},
+    {0, 4, "OggS", "audio/ogg"},
+    {0, 4, "fLaC", "audio/flac"},
+    {0, 3, "ID3", "audio/mpeg"},
+    {0, 4, "\x1a\x45\xdf\xa3", "video/x-matroska"},
+    {0, 4, "PK\x03\x04", "application/zip"},
+    {0, 2, "\x1f\x8b", "application/gzip"},
+    {0, 6, "7z\xbc\xaf\x27\x1c", "application/x-7z-compressed"},
+    {0, 3, "BZh", "application/x-bzip2"},
+    {0, 6, "Rar!\x1a\x07", "application/x-rar-compressed"},
+    {0, 2, "MZ", "application/x-msdownload"},
+    {0, 4, "wOFF", "font/woff"},
+    {0, 4, "wOF2", "font/woff2"},
+};
+
+// RIFF and ISO base media files say what they hold in the four bytes at
+// offset 8: the RIFF form type, or the major brand after "ftyp"
+typedef struct {
+    const char *tag;
+    const char *mime_type;
+} MimeBrand;
+
+static const MimeBrand riff_forms[] = {
+    {"WEBP", "image/webp"},
+    {"WAVE", "audio/wav"},
+    {"AVI ", "video/x-msvideo"},
+};
+
+static const MimeBrand ftyp_brands[] = {
+    {"isom", "video/mp4"},
+    {"iso2", "video/mp4"},
+    {"mp41", "video/mp4"},
+    {"mp42", "video/mp4"},
+    {"avc1", "video/mp4"},
+    {"M4V ", "video/mp4"},
+    {"M4A ", "audio/mp4"},
+    {"qt  ", "video/quicktime"},
+    {"3gp4", "video/3gpp"},
+    {"3gp5", "video/3gpp"},
+    {"heic", "image/heic"},
+    {"heix", "image/heic"},
+    {"mif1", "image/heif"},
+    {"avif", "image/avif"},
+};
+
+static const char *mime_brand(const MimeBrand *brands, size_t count, const unsigned char *tag, const char *type)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (memcmp(tag, brands[i].tag, 4) == 0)
+            return brands[i].mime_type;
+    }
+
+    return type;
+}
+
+// The type an attachment is announced with: from its extension, or from its
+// first bytes when the extension is unknown and sniffing is on
+static const char *attachment_mime_type(const char *fileName, const char *filePath)
+{
+    const char *type = get_mime_type(fileName);
+    unsigned char head[16];
+
+    if (type != mime_types[MIME_TYPE_COUNT].mime_type || !__atomic_load_n(&mimeSniffing, __ATOMIC_RELAXED))
+        return type;
+
+    int fd = open(filePath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return type;
+
+    ssize_t length = pread(fd, head, sizeof(head), 0);
+    close(fd);
+
+    // Unknown forms and brands keep the default rather than a wrong guess
+    if (length >= 12 && memcmp(head, "RIFF", 4) == 0)
+        return mime_brand(riff_forms, sizeof(riff_forms) / sizeof(MimeBrand), head + 8, type);
+
+    if (length >= 12 && memcmp(head + 4, "ftyp", 4) == 0)
+        return mime_brand(ftyp_brands, sizeof(ftyp_brands) / sizeof(MimeBrand), head + 8, type);
+
+    for (size_t i = 0; i < sizeof(mime_signatures) / sizeof(MimeSignature); i++) {
+        const MimeSignature *signature = &mime_signatures[i];
+
+        if (length >= (ssize_t)(signature->offset + signature->length)
+            && memcmp(head + signature->offset, signature->magic, signature->length) == 0)
+            return signature->mime_type;
+    }
+
+    return type;
+}
+
+static const char base64_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// A kernel encodes whole 3-byte groups from the front of src and returns how
+// many input bytes it consumed; the caller finishes the rest with the scalar
+// code. Kernels never read past src + srcLength.
+typedef size_t (*Base64Kernel)(char *dest, const unsigned char *src, size_t srcLength);
+
+static size_t base64_encode_scalar(char *dest, const unsigned char *src, size_t srcLength)
+{
+    char *out = dest;
+    size_t i = 0;
+
+    for (; i + 3 <= srcLength; i += 3) {
+        unsigned int v = src[i] << 16 | src[i + 1] << 8 | src[i + 2];
+
+        *out++ = base64_alphabet[v >> 18];
+        *out++ = base64_alphabet[(v >> 12) & 0x3f];
+        *out++ = base64_alphabet[(v >> 6) & 0x3f];
+        *out++ = base64_alphabet[v & 0x3f];
+    }
+
+    if (srcLength - i == 1) {
+        *out++ = base64_alphabet[src[i] >> 2];
+        *out++ = base64_alphabet[(src[i] & 0x03) << 4];
+        *out++ = '=';
+        *out++ = '=';
+    }
+    else if (srcLength - i == 2) {
+        *out++ = base64_alphabet[src[i] >> 2];
+        *out++ = base64_alphabet[(src[i] & 0x03) << 4 | src[i + 1] >> 4];
+        *out++ = base64_alphabet[(src[i + 1] & 0x0f) << 2];
+        *out++ = '=';
+    }
+
+    return out - dest;
+}
+
+#if !defined(__aarch64__)
+static size_t base64_kernel_scalar(char *dest, const unsigned char *src, size_t srcLength)
+{
+    (void)dest;
+    (void)src;
+    (void)srcLength;
+
+    return 0;
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Splits each 12-byte input lane into sixteen 6-bit indices and maps them to
+// ASCII with a 16-entry shuffle table (W. Mula, D. Lemire, "Faster Base64
+// Encoding and Decoding Using AVX2 Instructions", 2018).
+__attribute__((target("ssse3")))
+static inline __m128i base64_indices_ssse3(__m128i in)
+{
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+
+    const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+
+    return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i base64_ascii_ssse3(__m128i indices)
+{
+    const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                        '/' - 63, 'A', 0, 0);
+
+    __m128i result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    const __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+
+    result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+    result = _mm_shuffle_epi8(shift, result);
+
+    return _mm_add_epi8(result, indices);
+}
+
+__attribute__((target("ssse3")))
+static size_t base64_kernel_ssse3(char *dest, const unsigned char *src, size_t srcLength)
+{
+    size_t i = 0;
+
+    // Each step loads 16 bytes but only consumes 12
+    for (; i + 16 <= srcLength; i += 12) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+
+        _mm_storeu_si128((__m128i *)dest, base64_ascii_ssse3(base64_indices_ssse3(in)));
+        dest += 16;
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t base64_kernel_avx2(char *dest, const unsigned char *src, size_t srcLength)
+{
+    const __m256i shuffle = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                                            10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    const __m256i shift = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                           '/' - 63, 'A', 0, 0,
+                                           'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                           '/' - 63, 'A', 0, 0);
+    size_t i = 0;
+
+    // Two 12-byte lanes per step; the upper load reaches 4 bytes past the 24 consumed
+    for (; i + 28 <= srcLength; i += 24) {
+        __m256i in = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(src + i))),
+            _mm_loadu_si128((const __m128i *)(src + i + 12)), 1);
+
+        in = _mm256_shuffle_epi8(in, shuffle);
+
+        const __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+        const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        const __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+        const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        const __m256i indices = _mm256_or_si256(t1, t3);
+
+        __m256i result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        const __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+
+        result = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        result = _mm256_shuffle_epi8(shift, result);
+        result = _mm256_add_epi8(result, indices);
+
+        _mm256_storeu_si256((__m256i *)dest, result);
+        dest += 32;
+    }
+
+    return i;
+}
+
+#elif defined(__aarch64__)
+
+static size_t base64_kernel_neon(char *dest, const unsigned char *src, size_t srcLength)
+{
+    const uint8x16x4_t table = {{
+        vld1q_u8((const uint8_t *)base64_alphabet),
+        vld1q_u8((const uint8_t *)base64_alphabet + 16),
+        vld1q_u8((const uint8_t *)base64_alphabet + 32),
+        vld1q_u8((const uint8_t *)base64_alphabet + 48)
+    }};
+    const uint8x16_t mask3 = vdupq_n_u8(0x03);
+    const uint8x16_t mask15 = vdupq_n_u8(0x0f);
+    const uint8x16_t mask63 = vdupq_n_u8(0x3f);
+    size_t i = 0;
+
+    for (; i + 48 <= srcLength; i += 48) {
+        const uint8x16x3_t in = vld3q_u8(src + i);
+        uint8x16x4_t out;
+
+        out.val[0] = vshrq_n_u8(in.val[0], 2);
+        out.val[1] = vorrq_u8(vshlq_n_u8(vandq_u8(in.val[0], mask3), 4), vshrq_n_u8(in.val[1], 4));
+        out.val[2] = vorrq_u8(vshlq_n_u8(vandq_u8(in.val[1], mask15), 2), vshrq_n_u8(in.val[2], 6));
+        out.val[3] = vandq_u8(in.val[2], mask63);
+
+        out.val[0] = vqtbl4q_u8(table, out.val[0]);
+        out.val[1] = vqtbl4q_u8(table, out.val[1]);
+        out.val[2] = vqtbl4q_u8(table, out.val[2]);
+        out.val[3] = vqtbl4q_u8(table, out.val[3]);
+
+        vst4q_u8((uint8_t *)dest, out);
+        dest += 64;
+    }
+
+    return i;
+}
+
+#endif
+
+static pthread_once_t base64Once = PTHREAD_ONCE_INIT;
+static Base64Kernel base64Selected;
+
+// Picked once: encoder threads and senders may ask at the same time
+static void base64_select(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        base64Selected = base64_kernel_avx2;
+    else if (__builtin_cpu_supports("ssse3"))
+        base64Selected = base64_kernel_ssse3;
+    else
+        base64Selected = base64_kernel_scalar;
+#elif defined(__aarch64__)
+    base64Selected = base64_kernel_neon;
+#else
+    base64Selected = base64_kernel_scalar;
+#endif
+}
+
+static Base64Kernel base64_kernel(void)
+{
+    pthread_once(&base64Once, base64_select);
+    return base64Selected;
+}
+
+static size_t base64_encode_run(char *dest, const unsigned char *src, size_t srcLength, Base64Kernel kernel)
+{
+    size_t consumed = kernel(dest, src, srcLength);
+    size_t written = consumed / 3 * 4;
+
+    return written + base64_encode_scalar(dest + written, src + consumed, srcLength - consumed);
+}
+
+size_t smtp_base64_encoded_length(size_t srcLength, int lineWrap)
+{
+    size_t length = (srcLength + 2) / 3 * 4;
+
+    if (lineWrap)
+        length += (srcLength + BASE64_LINE_INPUT - 1) / BASE64_LINE_INPUT * 2;
+
+    return length;
+}
+
+size_t smtp_base64_encode(char *dest, const unsigned char *src, size_t srcLength, int lineWrap)
+{
+    Base64Kernel kernel = base64_kernel();
+    size_t written = 0;
+
+    if (!lineWrap)
+        return base64_encode_run(dest, src, srcLength, kernel);
+
+    // Encode a run of lines in one go, then split it into 76-column lines
+    while (srcLength > 0) {
+        char encoded[BASE64_LINE_INPUT * 16 / 3 * 4];
+        size_t run = srcLength > sizeof(encoded) / 4 * 3 ? sizeof(encoded) / 4 * 3 : srcLength;
+        size_t length = base64_encode_run(encoded, src, run, kernel);
+
+        size_t i = 0;
+
+        for (; i + 76 <= length; i += 76) {
+            memcpy(dest + written, encoded + i, 76);
+            memcpy(dest + written + 76, "\r\n", 2);
+            written += 78;
+        }
+
+        if (i < length) {
+            memcpy(dest + written, encoded + i, length - i);
+            written += length - i;
+            memcpy(dest + written, "\r\n", 2);
+            written += 2;
+        }
+
+        src += run;
+        srcLength -= run;
+    }
+
+    return written;
+}
+
+static void base64_encode(char* dest, char* src)
+{
+    size_t length = smtp_base64_encode(dest, (const unsigned char *)src, strlen(src), 0);
+
+    dest[length] = '\0';
+}
+
+// Memory a message owns: strings and list nodes are carved out of blocks
+// that are only released together
+typedef struct ArenaBlock ArenaBlock;
+struct ArenaBlock
+{
+    ArenaBlock *next;
+    size_t used;
+    size_t size;
+    max_align_t data[];
+};
+
+struct SMTPArena
+{
+    ArenaBlock *blocks;
+};
+
+#define ARENA_BLOCK_SIZE 4096
+
+static void arena_free(SMTPArena *arena);
+
+static void* arena_alloc(SMTPArena *arena, size_t length)
+{
+    ArenaBlock *block = arena->blocks;
+
+    length = (length + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+
+    if (!block || block->size - block->used < length)
+    {
+        size_t size = length > ARENA_BLOCK_SIZE ? length : ARENA_BLOCK_SIZE;
+
+        block = smtp_malloc(sizeof(ArenaBlock) + size);
+        if (!block)
+            return NULL;
+
+        block->used = 0;
+        block->size = size;
+
+        // An oversized block goes second so the current one keeps filling
+        if (arena->blocks && size > ARENA_BLOCK_SIZE)
+        {
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        }
+        else
+        {
+            block->next = arena->blocks;
+            arena->blocks = block;
+        }
+    }
+
+    void *memory = (char*)block->data + block->used;
+    block->used += length;
+    return memory;
+}
+
+// Empties the arena for reuse. When the last round needed several blocks
+// they are replaced by one that holds all of it, so a steady workload soon
+// stops allocating.
+static void arena_reset(SMTPArena *arena)
+{
+    ArenaBlock *block = arena->blocks;
+
+    if (!block)
+        return;
+
+    if (!block->next)
+    {
+        block->used = 0;
+        return;
+    }
+
+    size_t size = 0;
+
+    for (; block; block = block->next)
+        size += block->size;
+
+    arena_free(arena);
+
+    if ((block = smtp_malloc(sizeof(ArenaBlock) + size)))
+    {
+        block->next = NULL;
+        block->used = 0;
+        block->size = size;
+        arena->blocks = block;
+    }
+}
+
+static void arena_free(SMTPArena *arena)
+{
+    while (arena->blocks)
+    {
+        ArenaBlock *next = arena->blocks->next;
+
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+}
+
+static int arena_string(SMTPArena *arena, SMTPString *string, const char *data, size_t length)
+{
+    char *copy = arena_alloc(arena, length + 1);
+    if (!copy)
+        return -1;
+
+    memcpy(copy, data, length);
+    copy[length] = '\0';
+    string->data = copy;
+    string->length = length;
+    return 0;
+}
+
+MailMessage* smtp_message_create(void)
+{
+    MailMessage *message = smtp_calloc(1, sizeof(MailMessage) + sizeof(SMTPArena));
+    if (!message)
+        return NULL;
+
+    message->arena = (SMTPArena*)(message + 1);
+    message->subject.data = "";
+    message->body.data = "";
+    return message;
+}
+
+int smtp_message_set_subject(MailMessage *message, const char *subject)
+{
+    size_t length = strlen(subject);
+
+    // "Subject: " and the subject share one header line
+    if (length > 998 - 9)
+        return -1;
+
+    return arena_string(message->arena, &message->subject, subject, length);
+}
+
+int smtp_message_set_body(MailMessage *message, const char *body, size_t length, int isBodyHtml)
+{
+    message->isBodyHtml = isBodyHtml;
+    return arena_string(message->arena, &message->body, body, length);
+}
+
+int smtp_message_add_recipient(MailMessage *message, const char *emailAdress, RecipientType type)
+{
+    size_t length = strlen(emailAdress);
+
+    if (length > 254)
+        return -1;
+
+    RecipientListNode* new = arena_alloc(message->arena, sizeof(RecipientListNode));
+    if (!new || arena_string(message->arena, &new->recipient.emailAdress, emailAdress, length))
+        return -1;
+
+    new->recipient.type = type;
+    new->recipient.status = 0;
+    new->next = NULL;
+
+    // Appended, so header order follows insertion order
+    if (message->recipientList.tail)
+        message->recipientList.tail->next = new;
+    else
+        message->recipientList.head = new;
+
+    message->recipientList.tail = new;
+    message->recipientList.numberOfElements++;
+    return 0;
+}
+
+int smtp_message_add_attachment(MailMessage *message, const char *fileName, const char *filePath)
+{
+    size_t length = strlen(fileName);
+
+    if (length > 255)
+        return -1;
+
+    AttachementListNode* new = arena_alloc(message->arena, sizeof(AttachementListNode));
+    if (!new || arena_string(message->arena, &new->attachement.fileName, fileName, length)
+        || arena_string(message->arena, &new->attachement.filePath, filePath, strlen(filePath)))
+        return -1;
+
+    new->next = message->attachementList.head;
+    message->attachementList.head = new;
+    message->attachementList.numberOfElements++;
+    return 0;
+}
+
+void smtp_message_reset(MailMessage *message)
+{
+    SMTPArena *arena = message->arena;
+
+    arena_reset(arena);
+    memset(message, 0, sizeof(MailMessage));
+    message->arena = arena;
+    message->subject.data = "";
+    message->body.data = "";
+}
+
+void smtp_message_free(MailMessage *message)
+{
+    if (!message)
+        return;
+
+    arena_free(message->arena);
+    free(message);
+}
+
+// A server closing the connection must surface as a write error, not kill
+// the process. Left alone when the application installed its own handler.
+static void ignore_sigpipe(void)
+{
+    struct sigaction action;
+
+    if (sigaction(SIGPIPE, NULL, &action) == 0 && action.sa_handler == SIG_DFL)
+        signal(SIGPIPE, SIG_IGN);
+}
+
+// Every connection shares one TLS context for the life of the process. The
+// last session ticket each server handed out is kept per host and port and
+// offered on the next handshake, so repeated connections resume instead of
+// paying for a full handshake.
+typedef struct TLSCacheEntry TLSCacheEntry;
+struct TLSCacheEntry
+{
+    char key[1100];
+    SSL_SESSION *session;
+    TLSCacheEntry *next;
+};
+
+static pthread_once_t tlsOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t tlsLock = PTHREAD_MUTEX_INITIALIZER;
+static SSL_CTX *tlsContext;
+static int tlsKeyIndex = -1;
+static TLSCacheEntry *tlsCache;
+static SMTPTLSStats tlsStats;
+static int tlsKernelOffload;        // ask OpenSSL for kernel TLS, for sendfile()
+
+static TLSCacheEntry* tls_cache_find(const char *key)
+{
+    for (TLSCacheEntry *entry = tlsCache; entry; entry = entry->next) {
+        if (strcmp(entry->key, key) == 0)
+            return entry;
+    }
+
+    return NULL;
+}
+
+// OpenSSL hands over every new session here; TLS 1.3 tickets arrive after
+// the handshake, with the first reply read over the connection
+static int tls_new_session(SSL *ssl, SSL_SESSION *session)
+{
+    TLSCacheEntry *entry = SSL_get_ex_data(ssl, tlsKeyIndex);
+
+    if (!entry)
+        return 0;
+
+    pthread_mutex_lock(&tlsLock);
+
+    if (entry->session)
+        SSL_SESSION_free(entry->session);
+
+    entry->session = session;
+
+    pthread_mutex_unlock(&tlsLock);
+
+    // Keeping the reference
+    return 1;
+}
+
+static void tls_init(void)
+{
+    OPENSSL_init_ssl(0, NULL);
+
+    tlsContext = SSL_CTX_new(TLS_client_method());
+    if (!tlsContext)
+        return;
+
+    SSL_CTX_set_min_proto_version(tlsContext, TLS1_2_VERSION);
+
+    // Sessions live in tlsCache only, OpenSSL's internal store stays unused
+    SSL_CTX_set_session_cache_mode(tlsContext, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(tlsContext, tls_new_session);
+
+    tlsKeyIndex = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+}
+
+// A client-side TLS object for the connection on fd, offering the cached
+// session of this server when there is one
+static SSL* tls_new(int fd, const char *mailServer, int port)
+{
+    pthread_once(&tlsOnce, tls_init);
+
+    if (!tlsContext)
+        return NULL;
+
+    SSL *ssl = SSL_new(tlsContext);
+    if (!ssl)
+        return NULL;
+
+    SSL_set_fd(ssl, fd);
+    SSL_set_tlsext_host_name(ssl, mailServer);
+
+    // Taken up after the handshake when the kernel supports the cipher
+    if (__atomic_load_n(&tlsKernelOffload, __ATOMIC_RELAXED))
+        SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+
+    char key[1100];
+    snprintf(key, sizeof(key), "%s:%d", mailServer, port);
+
+    // Entries are never freed, so the connection can point at its own
+    pthread_mutex_lock(&tlsLock);
+
+    TLSCacheEntry *entry = tls_cache_find(key);
+    if (!entry && (entry = smtp_calloc(1, sizeof(TLSCacheEntry))))
+    {
+        strcpy(entry->key, key);
+        entry->next = tlsCache;
+        tlsCache = entry;
+    }
+
+    if (entry)
+    {
+        SSL_set_ex_data(ssl, tlsKeyIndex, entry);
+
+        if (entry->session)
+            SSL_set_session(ssl, entry->session);
+    }
+
+    pthread_mutex_unlock(&tlsLock);
+
+    return ssl;
+}
+
+// Counts a completed handshake as full or resumed
+static void tls_handshake_done(SSL *ssl)
+{
+    pthread_mutex_lock(&tlsLock);
+
+    if (SSL_session_reused(ssl))
+        tlsStats.resumedHandshakes++;
+    else
+        tlsStats.fullHandshakes++;
+
+    pthread_mutex_unlock(&tlsLock);
+}
+
+void smtp_tls_get_stats(SMTPTLSStats *stats)
+{
+    pthread_mutex_lock(&tlsLock);
+    *stats = tlsStats;
+    pthread_mutex_unlock(&tlsLock);
+}
+
+// Moves bytes for a session or an engine connection. read and write return
+// the number of bytes moved, 0 when a non-blocking socket would block (with
+// wantWrite set when it has to become writable first), or -1 once the
+// connection failed or the peer closed it. more tells write that further
+// output follows right away, so a plain socket can hold back a partial
+// segment.
+typedef struct Transport Transport;
+typedef struct UringIO UringIO;
+
+typedef struct TransportOps TransportOps;
+struct TransportOps
+{
+    long (*read)(Transport *transport, void *buffer, size_t length);
+    long (*write)(Transport *transport, const void *buffer, size_t length, int more);
+    long (*sendfile)(Transport *transport, int fd, off_t offset, size_t length);     // NULL when unsupported
+    void (*close)(Transport *transport, int clean);
+};
+
+struct Transport
+{
+    const TransportOps *ops;        // NULL while not connected
+    int fd;
+    SSL *ssl;
+    int wantWrite;
+    SMTPTransport custom;
+    UringIO *uring;                 // engine connections on io_uring
+};
+
+static long socket_read(Transport *transport, void *buffer, size_t length)
+{
+    for (;;)
+    {
+        long ret = recv(transport->fd, buffer, length, 0);
+
+        if (ret > 0)
+            return ret;
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            transport->wantWrite = 0;
+            return 0;
+        }
+
+        return -1;
+    }
+}
+
+static long socket_write(Transport *transport, const void *buffer, size_t length, int more)
+{
+    for (;;)
+    {
+        long ret = send(transport->fd, buffer, length, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+
+        if (ret >= 0)
+            return ret;
+
+        if (errno == EINTR)
+            continue;
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            transport->wantWrite = 1;
+            return 0;
+        }
+
+        return -1;
+    }
+}
+
+// Straight from the page cache; a file that ends early is an error
+static long socket_sendfile(Transport *transport, int fd, off_t offset, size_t length)
+{
+    for (;;)
+    {
+        long ret = sendfile(transport->fd, fd, &offset, length);
+
+        if (ret > 0)
+            return ret;
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            transport->wantWrite = 1;
+            return 0;
+        }
+
+        return -1;
+    }
+}
+
+static void socket_close(Transport *transport, int clean)
+{
+    (void)clean;
+    close(transport->fd);
+}
+
+// Shared by reads and writes, since TLS may need either direction for both
+static long tls_result(Transport *transport, int ret)
+{
+    if (ret > 0)
+        return ret;
+
+    int error = SSL_get_error(transport->ssl, ret);
+
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+    {
+        transport->wantWrite = error == SSL_ERROR_WANT_WRITE;
+        return 0;
+    }
+
+    return -1;
+}
+
+// SSL_get_error() is only meaningful with an empty error queue
+static long tls_read(Transport *transport, void *buffer, size_t length)
+{
+    ERR_clear_error();
+    return tls_result(transport, SSL_read(transport->ssl, buffer, length > INT_MAX ? INT_MAX : length));
+}
+
+// Records are already full-sized, so more has nothing left to coalesce
+static long tls_write(Transport *transport, const void *buffer, size_t length, int more)
+{
+    (void)more;
+
+    ERR_clear_error();
+    return tls_result(transport, SSL_write(transport->ssl, buffer, length > INT_MAX ? INT_MAX : length));
+}
+
+// Only called once kernel TLS has taken over sending, see transport_can_sendfile()
+static long tls_sendfile(Transport *transport, int fd, off_t offset, size_t length)
+{
+    ERR_clear_error();
+
+    ossl_ssize_t ret = SSL_sendfile(transport->ssl, fd, offset, length, 0);
+    return ret > 0 ? ret : tls_result(transport, -1);
+}
+
+// Servers forget sessions that ended without close_notify
+static void tls_close(Transport *transport, int clean)
+{
+    if (clean)
+    {
+        ERR_clear_error();
+        SSL_shutdown(transport->ssl);
+    }
+
+    SSL_free(transport->ssl);
+    close(transport->fd);
+}
+
+static long custom_read(Transport *transport, void *buffer, size_t length)
+{
+    long ret = transport->custom.read(transport->custom.context, buffer, length);
+    return ret > 0 ? ret : -1;
+}
+
+static long custom_write(Transport *transport, const void *buffer, size_t length, int more)
+{
+    (void)more;
+
+    long ret = transport->custom.write(transport->custom.context, buffer, length);
+    return ret > 0 ? ret : -1;
+}
+
+static void custom_close(Transport *transport, int clean)
+{
+    (void)clean;
+
+    if (transport->custom.close)
+        transport->custom.close(transport->custom.context);
+}
+
+static const TransportOps socketTransport = { socket_read, socket_write, socket_sendfile, socket_close };
+static const TransportOps tlsTransport = { tls_read, tls_write, tls_sendfile, tls_close };
+static const TransportOps customTransport = { custom_read, custom_write, NULL, custom_close };
+
+// io_uring through its system calls, for the engine. Entries are queued
+// without a system call and handed to the kernel by the next io_uring_enter(),
+// which also waits for completions; one call per engine round covers every
+// connection.
+typedef struct Uring Uring;
+struct Uring
+{
+    int fd;
+    unsigned entries;
+    unsigned toSubmit;          // queued since the last io_uring_enter()
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+    void *rings;
+    size_t ringsSize;
+    size_t sqesSize;
+};
+
+#define URING_ENTRIES 256
+#define URING_SEND_SIZE (8 * TLS_RECORD_SIZE)
+#define URING_RECV_SIZE (2 * TLS_RECORD_SIZE)
+
+// The low bits of an operation's user_data tell what it was
+enum
+{
+    URING_POLL,
+    URING_RECV,
+    URING_SEND,
+    URING_CANCEL
+};
+
+// A connection's socket on io_uring. Writes are copied into the send buffer
+// and go out in one operation with whatever follows while it is in flight; a
+// receive is always outstanding into the receive buffer, whose bytes reads
+// then take. The buffers are only reused once pending is back at 0.
+struct UringIO
+{
+    Uring *ring;
+    int pending;
+    int sendBusy;
+    int recvBusy;
+    int pollBusy;
+    int sendMore;
+    int failed;             // the peer closed or a send or receive failed
+    int closed;             // the socket is closed, nothing more is queued
+    char *sendBuffer;
+    size_t sendStart;
+    size_t sendEnd;
+    char *recvBuffer;
+    size_t recvStart;
+    size_t recvEnd;
+};
+
+static int uring_setup(Uring *ring)
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = 8 * URING_ENTRIES;
+
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0)
+        return -1;
+
+    // Timed waits, completions that never get dropped and one mapping for both
+    // rings: kernel 5.11 or later
+    unsigned required = IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP | IORING_FEAT_SINGLE_MMAP;
+
+    if ((params.features & required) != required)
+    {
+        close(ring->fd);
+        return -1;
+    }
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    ring->ringsSize = sqSize > cqSize ? sqSize : cqSize;
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->rings = mmap(NULL, ring->ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if (ring->rings == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        if (ring->rings != MAP_FAILED)
+            munmap(ring->rings, ring->ringsSize);
+
+        if (ring->sqes != MAP_FAILED)
+            munmap(ring->sqes, ring->sqesSize);
+
+        close(ring->fd);
+        return -1;
+    }
+
+    char *rings = ring->rings;
+
+    ring->entries = params.sq_entries;
+    ring->toSubmit = 0;
+    ring->sqHead = (unsigned*)(rings + params.sq_off.head);
+    ring->sqTail = (unsigned*)(rings + params.sq_off.tail);
+    ring->sqMask = *(unsigned*)(rings + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*)(rings + params.sq_off.array);
+    ring->cqHead = (unsigned*)(rings + params.cq_off.head);
+    ring->cqTail = (unsigned*)(rings + params.cq_off.tail);
+    ring->cqMask = *(unsigned*)(rings + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(rings + params.cq_off.cqes);
+    return 0;
+}
+
+static void uring_teardown(Uring *ring)
+{
+    munmap(ring->sqes, ring->sqesSize);
+    munmap(ring->rings, ring->ringsSize);
+    close(ring->fd);
+}
+
+// Submits what is queued and, when wait is set, waits up to timeoutMs (-1
+// for ever) for at least one completion
+static int uring_enter(Uring *ring, int wait, int timeoutMs)
+{
+    struct __kernel_timespec ts = { timeoutMs / 1000, (long long)(timeoutMs % 1000) * 1000000 };
+    struct io_uring_getevents_arg arg = { .ts = timeoutMs >= 0 ? (uint64_t)(uintptr_t)&ts : 0 };
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+
+    if (!wait && !ring->toSubmit)
+        return 0;
+
+    long ret = syscall(__NR_io_uring_enter, ring->fd, ring->toSubmit, wait ? 1 : 0, flags, wait ? &arg : NULL, sizeof(arg));
+
+    if (ret >= 0)
+    {
+        ring->toSubmit -= ret;
+        return 0;
+    }
+
+    // A timeout, a signal, or completions the application has to reap first
+    return errno == ETIME || errno == EINTR || errno == EBUSY || errno == EAGAIN ? 0 : -1;
+}
+
+// A cleared entry at the tail of the submission queue, made visible by
+// uring_commit() once filled in. NULL when the kernel cannot take more.
+static struct io_uring_sqe* uring_sqe(Uring *ring)
+{
+    unsigned tail = *ring->sqTail;
+
+    if (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->entries)
+    {
+        uring_enter(ring, 0, 0);
+
+        if (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->entries)
+            return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sqMask];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sqArray[tail & ring->sqMask] = tail & ring->sqMask;
+    return sqe;
+}
+
+static void uring_commit(Uring *ring)
+{
+    __atomic_store_n(ring->sqTail, *ring->sqTail + 1, __ATOMIC_RELEASE);
+    ring->toSubmit++;
+}
+
+// Queues an operation on the transport's socket; user_data points at its
+// UringIO with the kind in the low bits. flags are the send or receive flags,
+// or the events a poll waits for.
+static int uring_queue(Transport *transport, int opcode, int kind, void *buffer, size_t length, unsigned flags)
+{
+    UringIO *io = transport->uring;
+
+    if (io->closed)
+        return -1;
+
+    struct io_uring_sqe *sqe = uring_sqe(io->ring);
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = opcode;
+    sqe->fd = transport->fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+
+    if (opcode == IORING_OP_POLL_ADD)
+        sqe->poll32_events = flags;
+    else
+        sqe->msg_flags = flags;
+
+    sqe->len = length;
+    sqe->user_data = (uint64_t)(uintptr_t)io | kind;
+    uring_commit(io->ring);
+
+    io->pending++;
+    return 0;
+}
+
+static int uring_send(Transport *transport)
+{
+    UringIO *io = transport->uring;
+
+    if (uring_queue(transport, IORING_OP_SEND, URING_SEND, io->sendBuffer + io->sendStart, io->sendEnd - io->sendStart,
+                    MSG_NOSIGNAL | (io->sendMore ? MSG_MORE : 0)))
+        return -1;
+
+    io->sendBusy = 1;
+    return 0;
+}
+
+static int uring_recv(Transport *transport)
+{
+    UringIO *io = transport->uring;
+
+    if (uring_queue(transport, IORING_OP_RECV, URING_RECV, io->recvBuffer, URING_RECV_SIZE, 0))
+        return -1;
+
+    io->recvBusy = 1;
+    return 0;
+}
+
+static int uring_poll(Transport *transport, unsigned events)
+{
+    UringIO *io = transport->uring;
+
+    if (uring_queue(transport, IORING_OP_POLL_ADD, URING_POLL, NULL, 0, events))
+        return -1;
+
+    io->pollBusy = 1;
+    return 0;
+}
+
+// Asks the kernel to give up an outstanding operation of the given kind
+static void uring_cancel(UringIO *io, int kind)
+{
+    struct io_uring_sqe *sqe = uring_sqe(io->ring);
+    if (!sqe)
+        return;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)io | kind;
+    sqe->user_data = (uint64_t)(uintptr_t)io | URING_CANCEL;
+    uring_commit(io->ring);
+    io->pending++;
+}
+
+static long uring_read(Transport *transport, void *buffer, size_t length)
+{
+    UringIO *io = transport->uring;
+
+    if (io->recvStart < io->recvEnd)
+    {
+        size_t copy = io->recvEnd - io->recvStart;
+
+        if (copy > length)
+            copy = length;
+
+        memcpy(buffer, io->recvBuffer + io->recvStart, copy);
+        io->recvStart += copy;
+
+        // Emptied: the next receive goes out right away
+        if (io->recvStart == io->recvEnd)
+        {
+            io->recvStart = io->recvEnd = 0;
+            if (!io->failed)
+                uring_recv(transport);
+        }
+
+        return copy;
+    }
+
+    if (io->failed)
+        return -1;
+
+    if (!io->recvBusy && uring_recv(transport))
+        return -1;
+
+    transport->wantWrite = 0;
+    return 0;
+}
+
+static long uring_write(Transport *transport, const void *buffer, size_t length, int more)
+{
+    UringIO *io = transport->uring;
+
+    if (io->failed)
+        return -1;
+
+    size_t copy = URING_SEND_SIZE - io->sendEnd;
+
+    if (copy == 0)
+    {
+        transport->wantWrite = 1;
+        return 0;
+    }
+
+    if (copy > length)
+        copy = length;
+
+    memcpy(io->sendBuffer + io->sendEnd, buffer, copy);
+    io->sendEnd += copy;
+    io->sendMore = more;
+
+    if (!io->sendBusy && uring_send(transport))
+        return -1;
+
+    return copy;
+}
+
+// After a clean end the last send, such as a close_notify, still goes out.
+// Queued operations are submitted first: the kernel looks the descriptor up
+// then, and its number may be reused once closed.
+static void uring_close(Transport *transport, int clean)
+{
+    UringIO *io = transport->uring;
+
+    if (io->recvBusy)
+        uring_cancel(io, URING_RECV);
+
+    if (io->pollBusy)
+        uring_cancel(io, URING_POLL);
+
+    if (io->sendBusy && !clean)
+        uring_cancel(io, URING_SEND);
+
+    io->closed = 1;
+    uring_enter(io->ring, 0, 0);
+    close(transport->fd);
+}
+
+static void uring_tls_close(Transport *transport, int clean)
+{
+    if (clean)
+    {
+        ERR_clear_error();
+        SSL_shutdown(transport->ssl);
+    }
+
+    SSL_free(transport->ssl);
+    uring_close(transport, clean);
+}
+
+// OpenSSL reads and writes io_uring connections through the same buffers
+static pthread_once_t uringBioOnce = PTHREAD_ONCE_INIT;
+static BIO_METHOD *uringBioMethod;
+
+static int uring_bio_write(BIO *bio, const char *data, int length)
+{
+    long ret = uring_write(BIO_get_data(bio), data, length, 0);
+
+    BIO_clear_retry_flags(bio);
+    if (ret == 0)
+        BIO_set_retry_write(bio);
+
+    return ret > 0 ? (int)ret : -1;
+}
+
+static int uring_bio_read(BIO *bio, char *data, int length)
+{
+    long ret = uring_read(BIO_get_data(bio), data, length);
+
+    BIO_clear_retry_flags(bio);
+    if (ret == 0)
+        BIO_set_retry_read(bio);
+
+    return ret > 0 ? (int)ret : -1;
+}
+
+static long uring_bio_ctrl(BIO *bio, int command, long number, void *pointer)
+{
+    (void)bio;
+    (void)number;
+    (void)pointer;
+
+    // Everything written is already on its way
+    return command == BIO_CTRL_FLUSH;
+}
+
+static int uring_bio_create(BIO *bio)
+{
+    BIO_set_init(bio, 1);
+    return 1;
+}
+
+static void uring_bio_init(void)
+{
+    BIO_METHOD *method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "smtp io_uring");
+
+    if (method && (!BIO_meth_set_write(method, uring_bio_write) || !BIO_meth_set_read(method, uring_bio_read)
+                   || !BIO_meth_set_ctrl(method, uring_bio_ctrl) || !BIO_meth_set_create(method, uring_bio_create)))
+    {
+        BIO_meth_free(method);
+        method = NULL;
+    }
+
+    uringBioMethod = method;
+}
+
+static const TransportOps uringTransport = { uring_read, uring_write, NULL, uring_close };
+static const TransportOps uringTlsTransport = { tls_read, tls_write, NULL, uring_tls_close };
+
+// Files can be sent over plain sockets, and over TLS once the kernel encrypts
+static int transport_can_sendfile(Transport *transport)
+{
+    if (!transport->ops || !transport->ops->sendfile)
+        return 0;
+
+    return !transport->ssl || BIO_get_ktls_send(SSL_get_wbio(transport->ssl));
+}
+
+static void transport_close(Transport *transport, int clean)
+{
+    if (transport->ops)
+        transport->ops->close(transport, clean);
+    else if (transport->fd >= 0)
+        close(transport->fd);
+
+    transport->ops = NULL;
+    transport->fd = -1;
+    transport->ssl = NULL;
+    transport->wantWrite = 0;
+}
+
+// Wraps the connected socket in TLS; the handshake is left to the caller
+static int transport_start_tls(Transport *transport, SMTPClient *client)
+{
+    transport->ssl = tls_new(transport->fd, client->mailServer, client->port);
+    if (!transport->ssl)
+        return -1;
+
+    transport->ops = &tlsTransport;
+    return 0;
+}
+
+// Called with the text of every line of a reply, without the code and CRLF
+typedef void (*ReplyLineHandler)(void *context, const char *text, size_t length);
+
+// Parses replies incrementally out of a connection's input buffer without
+// allocating. Lines may arrive split across any number of reads; a line
+// longer than the whole buffer is consumed in pieces with only its start
+// kept. reply holds the last complete reply.
+typedef struct ReplyParser ReplyParser;
+struct ReplyParser
+{
+    SMTPReply reply;
+    int complete;           // reply is finished, the next line starts a new one
+    int skipping;           // inside a line too long for the buffer
+    int skippedLast;        // whether that line ends the reply
+};
+
+// Output is collected in out and written once a reply is needed, or in whole
+// TLS records when the buffer fills up
+struct SMTPSession
+{
+    SMTPClient client;
+    int enableLogs;
+    Transport transport;
+    int customTransport;        // cannot reconnect on its own
+    int broken;
+    Capabilities capabilities;
+    int transactions;
+    int failureCode;        // reply that failed the last transaction, other than RCPT TO
+    time_t lastActivity;
+    SMTPSession *poolNext;
+    SMTPArena arena;            // per-message allocations, reset for each
+    ReplyParser parser;
+    SMTPReply lastReply;        // kept across reconnects
+    char buffer[4096];
+    size_t bufferLength;
+    char out[4 * TLS_RECORD_SIZE];
+    size_t outLength;
+};
+
+static void session_disconnect(SMTPSession *session)
+{
+    transport_close(&session->transport, !session->broken);
+
+    session->bufferLength = 0;
+    session->outLength = 0;
+    memset(&session->parser, 0, sizeof(ReplyParser));
+    session->transactions = 0;
+    session->broken = 0;
+}
+
+static int session_write_all(SMTPSession *session, const char *data, size_t length, int more)
+{
+    while (length > 0)
+    {
+        long ret = session->transport.ops ? session->transport.ops->write(&session->transport, data, length, more) : -1;
+
+        if (ret <= 0)
+        {
+            session->broken = 1;
+            return -1;
+        }
+
+        data += ret;
+        length -= ret;
+    }
+
+    session->lastActivity = time(NULL);
+    return 0;
+}
+
+// Writes everything buffered; called when a reply is needed
+static int session_flush(SMTPSession *session)
+{
+    size_t length = session->outLength;
+
+    session->outLength = 0;
+    return session_write_all(session, session->out, length, 0);
+}
+
+// Writes the full records at the front of the buffer and keeps the rest
+static int session_flush_records(SMTPSession *session)
+{
+    size_t length = session->outLength - session->outLength % TLS_RECORD_SIZE;
+
+    if (length == 0)
+        return 0;
+
+    if (session_write_all(session, session->out, length, 1))
+    {
+        session->outLength = 0;
+        return -1;
+    }
+
+    session->outLength -= length;
+    memmove(session->out, session->out + length, session->outLength);
+    return 0;
+}
+
+// Returns room for length more bytes at the end of the buffer, which the
+// caller fills and accounts for in outLength
+static char* session_reserve(SMTPSession *session, size_t length)
+{
+    if (sizeof(session->out) - session->outLength < length && session_flush_records(session))
+        return NULL;
+
+    return session->out + session->outLength;
+}
+
+static int session_write(SMTPSession *session, const void *data, size_t length)
+{
+    const char *bytes = data;
+
+    while (length > 0)
+    {
+        if (session->outLength == sizeof(session->out) && session_flush_records(session))
+            return -1;
+
+        size_t copy = sizeof(session->out) - session->outLength;
+        if (copy > length)
+            copy = length;
+
+        memcpy(session->out + session->outLength, bytes, copy);
+        session->outLength += copy;
+        bytes += copy;
+        length -= copy;
+    }
+
+    return 0;
+}
+
+// Checks the "ddd" code and the separator that follows it. *last is set for
+// "ddd " and a bare "ddd", which end a reply; "ddd-" continues it.
+static int reply_line_header(const char *line, size_t length, int *code, int *last)
+{
+    if (length < 3 || line[0] < '2' || line[0] > '5' || line[1] < '0' || line[1] > '9' || line[2] < '0' || line[2] > '9')
+        return -1;
+
+    if (length > 3 && line[3] != ' ' && line[3] != '-' && line[3] != '\r' && line[3] != '\n')
+        return -1;
+
+    *code = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+    *last = length == 3 || line[3] != '-';
+    return 0;
+}
+
+static void reply_append_text(SMTPReply *reply, const char *text, size_t length)
+{
+    size_t room = sizeof(reply->text) - 1 - reply->textLength;
+
+    if (reply->lines > 1 && room)
+    {
+        reply->text[reply->textLength++] = '\n';
+        room--;
+    }
+
+    if (length > room)
+        length = room;
+
+    memcpy(reply->text + reply->textLength, text, length);
+    reply->textLength += length;
+    reply->text[reply->textLength] = '\0';
+}
+
+// Starts one line of the reply in progress; line holds at least its header
+static int reply_parse_line(ReplyParser *parser, const char *line, size_t length, int *last, ReplyLineHandler handler, void *context)
+{
+    SMTPReply *reply = &parser->reply;
+    int code;
+
+    if (parser->complete)
+    {
+        memset(reply, 0, sizeof(SMTPReply));
+        parser->complete = 0;
+    }
+
+    if (reply_line_header(line, length, &code, last))
+        return -1;
+
+    // Every line of a reply carries the same code
+    if (reply->lines && code != reply->code)
+        return -1;
+
+    reply->code = code;
+    reply->lines++;
+
+    size_t textLength = length > 4 ? length - 4 : 0;
+
+    while (textLength && (line[4 + textLength - 1] == '\n' || line[4 + textLength - 1] == '\r'))
+        textLength--;
+
+    reply_append_text(reply, line + 4, textLength);
+
+    if (handler)
+        handler(context, line + 4, textLength);
+
+    return 0;
+}
+
+// Consumes complete lines from the front of buffer. Returns 1 once a whole
+// reply has been parsed into parser->reply, 0 when more input is needed and
+// -1 when the server is not speaking SMTP. Bytes past the reply stay in
+// buffer for the next call.
+static int reply_parse(ReplyParser *parser, char *buffer, size_t *bufferLength, size_t capacity, int enableLogs, ReplyLineHandler handler, void *context)
+{
+    size_t offset = 0;
+    int result = 0;
+
+    while (result == 0 && offset < *bufferLength)
+    {
+        char *line = buffer + offset;
+        size_t available = *bufferLength - offset;
+        char *end = memchr(line, '\n', available);
+        int last;
+
+        if (!end)
+        {
+            // A line filling the whole buffer is taken in pieces
+            if (offset == 0 && available == capacity)
+            {
+                if (enableLogs)
+                    log_protocol(SMTP_LOG_SERVER, line, available, 0);
+
+                if (!parser->skipping)
+                {
+                    result = reply_parse_line(parser, line, available, &parser->skippedLast, handler, context) ? -1 : 0;
+                    parser->skipping = 1;
+                }
+
+                offset = available;
+            }
+
+            break;
+        }
+
+        size_t lineLength = end - line + 1;
+
+        if (enableLogs)
+            log_protocol(SMTP_LOG_SERVER, line, lineLength, 0);
+
+        if (parser->skipping)
+        {
+            parser->skipping = 0;
+            last = parser->skippedLast;
+        }
+        else if (reply_parse_line(parser, line, lineLength, &last, handler, context))
+            result = -1;
+
+        offset += lineLength;
+
+        if (result == 0 && last)
+        {
+            parser->complete = 1;
+            result = 1;
+        }
+    }
+
+    *bufferLength -= offset;
+    memmove(buffer, buffer + offset, *bufferLength);
+    return result;
+}
+
+// Reads one complete (possibly multi-line) reply and returns its code, or -1
+// when the connection is gone. Bytes past the reply stay in session->buffer.
+static int session_read_reply_lines(SMTPSession *session, ReplyLineHandler handler, void *context)
+{
+    int ret;
+
+    if (session->outLength && session_flush(session))
+        return -1;
+
+    while ((ret = reply_parse(&session->parser, session->buffer, &session->bufferLength, sizeof(session->buffer), session->enableLogs, handler, context)) == 0)
+    {
+        long length = -1;
+
+        if (session->transport.ops)
+            length = session->transport.ops->read(&session->transport, session->buffer + session->bufferLength, sizeof(session->buffer) - session->bufferLength);
+
+        if (length <= 0)
+        {
+            session->broken = 1;
+            return -1;
+        }
+
+        session->bufferLength += length;
+    }
+
+    if (ret < 0)
+    {
+        session->broken = 1;
+        return -1;
+    }
+
+    session->lastReply = session->parser.reply;
+    int code = session->lastReply.code;
+
+    if (code == 421)
+        session->broken = 1;
+
+    session->lastActivity = time(NULL);
+    return code;
+}
+
+static int session_read_reply(SMTPSession *session)
+{
+    return session_read_reply_lines(session, NULL, NULL);
+}
+
+static int session_exchange(SMTPSession *session, const char *req, int secret)
+{
+    size_t length = strlen(req);
+
+    if (session->enableLogs)
+        log_protocol(SMTP_LOG_CLIENT, req, length, secret);
+
+    if (session_write(session, req, length))
+        return -1;
+
+    return session_read_reply(session);
+}
+
+static int session_command(SMTPSession *session, const char *req)
+{
+    return session_exchange(session, req, 0);
+}
+
+// A command carrying credentials, kept out of the log
+static int session_secret_command(SMTPSession *session, const char *req)
+{
+    return session_exchange(session, req, 1);
+}
+
+static int capability_is(const char *text, size_t length, const char *keyword)
+{
+    size_t keywordLength = strlen(keyword);
+
+    return length >= keywordLength && strncasecmp(text, keyword, keywordLength) == 0
+           && (length == keywordLength || text[keywordLength] == ' ');
+}
+
+static void parse_capability(void *context, const char *text, size_t length)
+{
+    Capabilities *capabilities = context;
+
+    if (capability_is(text, length, "PIPELINING"))
+        capabilities->flags |= CAPABILITY_PIPELINING;
+    else if (capability_is(text, length, "8BITMIME"))
+        capabilities->flags |= CAPABILITY_8BITMIME;
+    else if (capability_is(text, length, "CHUNKING"))
+        capabilities->flags |= CAPABILITY_CHUNKING;
+    else if (capability_is(text, length, "SMTPUTF8"))
+        capabilities->flags |= CAPABILITY_SMTPUTF8;
+    else if (capability_is(text, length, "SIZE"))
+    {
+        // "SIZE" alone or "SIZE 0" means there is no fixed limit
+        capabilities->flags |= CAPABILITY_SIZE;
+        capabilities->maxSize = length > 5 ? strtoull(text + 5, NULL, 10) : 0;
+    }
+}
+
+// What each server offered the last time it was asked, so a message it
+// cannot take fails before a connection is even opened
+typedef struct CapabilityCacheEntry CapabilityCacheEntry;
+struct CapabilityCacheEntry
+{
+    char key[1100];
+    Capabilities capabilities;
+    CapabilityCacheEntry *next;
+};
+
+static pthread_mutex_t capabilityLock = PTHREAD_MUTEX_INITIALIZER;
+static CapabilityCacheEntry *capabilityCache;
+
+static void capability_key(char *key, size_t size, SMTPClient *client)
+{
+    snprintf(key, size, "%s:%d", client->mailServer, client->port);
+}
+
+static void capability_cache_store(SMTPClient *client, Capabilities *capabilities)
+{
+    char key[1100];
+    CapabilityCacheEntry *entry;
+
+    capability_key(key, sizeof(key), client);
+    pthread_mutex_lock(&capabilityLock);
+
+    for (entry = capabilityCache; entry; entry = entry->next) {
+        if (strcmp(entry->key, key) == 0)
+            break;
+    }
+
+    if (!entry && (entry = smtp_calloc(1, sizeof(CapabilityCacheEntry))))
+    {
+        strcpy(entry->key, key);
+        entry->next = capabilityCache;
+        capabilityCache = entry;
+    }
+
+    if (entry)
+        entry->capabilities = *capabilities;
+
+    pthread_mutex_unlock(&capabilityLock);
+}
+
+// Returns 0 and fills capabilities when the server has been seen before
+static int capability_cache_find(SMTPClient *client, Capabilities *capabilities)
+{
+    char key[1100];
+    int ret = -1;
+
+    capability_key(key, sizeof(key), client);
+    pthread_mutex_lock(&capabilityLock);
+
+    for (CapabilityCacheEntry *entry = capabilityCache; entry; entry = entry->next) {
+        if (strcmp(entry->key, key) == 0)
+        {
+            *capabilities = entry->capabilities;
+            ret = 0;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&capabilityLock);
+    return ret;
+}
+
+// A message the server announced it cannot take
+static int capability_too_large(Capabilities *capabilities, size_t estimate)
+{
+    return (capabilities->flags & CAPABILITY_SIZE) && capabilities->maxSize && estimate > capabilities->maxSize;
+}
+
+static int session_ehlo(SMTPSession *session)
+{
+    const char *req = "EHLO localhost\r\n";
+    uint64_t started = metrics_now();
+
+    if (session->enableLogs)
+        log_protocol(SMTP_LOG_CLIENT, req, strlen(req), 0);
+
+    memset(&session->capabilities, 0, sizeof(Capabilities));
+
+    if (session_write(session, req, strlen(req)))
+        return -1;
+
+    int code = session_read_reply_lines(session, parse_capability, &session->capabilities);
+
+    if (code == 250)
+    {
+        capability_cache_store(&session->client, &session->capabilities);
+        metrics_record(SMTP_PHASE_EHLO, started, 0);
+    }
+
+    return code;
+}
+
+static int session_start_tls(SMTPSession *session)
+{
+    uint64_t started = metrics_now();
+
+    if (transport_start_tls(&session->transport, &session->client))
+        return -1;
+
+    if (SSL_connect(session->transport.ssl) != 1)
+        return -1;
+
+    tls_handshake_done(session->transport.ssl);
+    metrics_record(SMTP_PHASE_TLS, started, 0);
+    return 0;
+}
+
+// One base64 line of the AUTH LOGIN exchange; req needs 4096 bytes
+static void auth_login_line(char *req, char *value)
+{
+    base64_encode(req, value);
+    strcat(req, "\r\n");
+}
+
+// The whole AUTH XOAUTH2 command; req needs 4096 bytes
+static void auth_xoauth2_command(char *req, SMTPClient *client)
+{
+    char temp[3072] = {0};
+
+    snprintf(temp, sizeof(temp), "user=%s%cauth=Bearer %s%c%c", client->emailAdress, 0x01, client->secretCode, 0x01, 0x01);
+
+    strcpy(req, "AUTH XOAUTH2 ");
+    base64_encode(req + strlen(req), temp);
+    strcat(req, "\r\n");
+}
+
+static int session_authenticate(SMTPSession *session)
+{
+    SMTPClient *client = &session->client;
+    uint64_t started = metrics_now();
+    char req[4096];
+
+    if (client->authType == LOGIN)
+    {
+        if (session_command(session, "AUTH LOGIN\r\n") != 334)
+            return -1;
+
+        auth_login_line(req, client->emailAdress);
+        if (session_secret_command(session, req) != 334)
+            return -1;
+
+        auth_login_line(req, client->secretCode);
+        if (session_secret_command(session, req) != 235)
+            return -1;
+    }
+    else
+    {
+        auth_xoauth2_command(req, client);
+        if (session_command(session, req) != 235)
+            return -1;
+    }
+
+    metrics_record(SMTP_PHASE_AUTH, started, 0);
+    return 0;
+}
+
+// The dialog from the greeting to a successful AUTH, over whatever
+// transport the session has. Application transports handle their own
+// encryption, so STARTTLS is only used on sockets the library opened.
+static int session_greet(SMTPSession *session)
+{
+    SMTPClient *client = &session->client;
+    uint64_t started = metrics_now();
+
+    if (session_read_reply(session) != 220)
+        goto fail;
+
+    metrics_record(SMTP_PHASE_GREETING, started, 0);
+
+    if (session_ehlo(session) != 250)
+        goto fail;
+
+    if (client->port != 465 && client->enableSSL && !session->customTransport)
+    {
+        if (session_command(session, "STARTTLS\r\n") != 220)
+            goto fail;
+
+        // Anything already buffered was sent in plaintext before the handshake
+        if (session->bufferLength || session_start_tls(session))
+            goto fail;
+
+        if (session_ehlo(session) != 250)
+            goto fail;
+    }
+
+    if (session_authenticate(session))
+        goto fail;
+
+    return 0;
+
+fail:
+    session_disconnect(session);
+    return -1;
+}
+
+static int session_connect(SMTPSession *session)
+{
+    SMTPClient *client = &session->client;
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *res, *ai;
+
+    // An application transport that was closed cannot be reopened
+    if (session->customTransport)
+        return -1;
+
+    char port[10] = {0};
+    sprintf(port, "%d", client->port);
+
+    uint64_t started = metrics_now();
+
+    if (getaddrinfo(client->mailServer, port, &hints, &res) != 0)
+        return -1;
+
+    metrics_record(SMTP_PHASE_DNS, started, 0);
+    started = metrics_now();
+
+    for (ai = res; ai; ai = ai->ai_next)
+    {
+        session->transport.fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (session->transport.fd < 0)
+            continue;
+
+        if (connect(session->transport.fd, ai->ai_addr, ai->ai_addrlen) == 0)
+        {
+            // Output is only written when a reply is due or in whole records
+            setsockopt(session->transport.fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+            break;
+        }
+
+        close(session->transport.fd);
+        session->transport.fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (session->transport.fd < 0)
+        return -1;
+
+    metrics_record(SMTP_PHASE_CONNECT, started, 0);
+    session->transport.ops = &socketTransport;
+
+    if (client->port == 465 && session_start_tls(session))
+    {
+        session_disconnect(session);
+        return -1;
+    }
+
+    return session_greet(session);
+}
+
+// Encoded attachment bodies kept across sends. Entries are matched on path,
+// size and modification time, so a file that changed is encoded again.
+// Writers hold a reference while streaming an entry, which keeps it alive
+// after eviction until the last one is done with it. Encodings too large for
+// memory may be kept in unlinked files instead, with a limit of their own.
+typedef struct AttachmentCacheEntry AttachmentCacheEntry;
+struct AttachmentCacheEntry
+{
+    char path[1024];
+    off_t size;
+    struct timespec mtime;
+    char *data;
+    int fd;                 // the encoded file, -1 when data holds the encoding
+    size_t length;
+    int references;
+    int cached;
+    AttachmentCacheEntry *prev;
+    AttachmentCacheEntry *next;
+};
+
+static pthread_mutex_t attachmentCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static size_t attachmentCacheLimit;
+static size_t attachmentFileLimit;
+static char attachmentFileDirectory[1024];
+static AttachmentCacheEntry *attachmentCacheHead;     // most recently used first
+static AttachmentCacheEntry *attachmentCacheTail;
+static SMTPAttachmentCacheStats attachmentCacheStats;
+
+static void attachment_cache_unlink(AttachmentCacheEntry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        attachmentCacheHead = entry->next;
+
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        attachmentCacheTail = entry->prev;
+
+    entry->prev = entry->next = NULL;
+    entry->cached = 0;
+
+    if (entry->fd >= 0)
+    {
+        attachmentCacheStats.fileEntries--;
+        attachmentCacheStats.fileBytes -= entry->length;
+    }
+    else
+    {
+        attachmentCacheStats.entries--;
+        attachmentCacheStats.bytes -= entry->length;
+    }
+}
+
+static void attachment_cache_push(AttachmentCacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = attachmentCacheHead;
+
+    if (attachmentCacheHead)
+        attachmentCacheHead->prev = entry;
+    else
+        attachmentCacheTail = entry;
+
+    attachmentCacheHead = entry;
+    entry->cached = 1;
+
+    if (entry->fd >= 0)
+    {
+        attachmentCacheStats.fileEntries++;
+        attachmentCacheStats.fileBytes += entry->length;
+    }
+    else
+    {
+        attachmentCacheStats.entries++;
+        attachmentCacheStats.bytes += entry->length;
+    }
+}
+
+// Called with the lock held
+static void attachment_cache_unref(AttachmentCacheEntry *entry)
+{
+    if (--entry->references == 0 && !entry->cached)
+    {
+        if (entry->fd >= 0)
+            close(entry->fd);
+
+        free(entry->data);
+        free(entry);
+    }
+}
+
+// Drops least recently used entries held in memory, or in files, until
+// length more bytes of that kind fit
+static void attachment_cache_trim(size_t length, int file)
+{
+    size_t *bytes = file ? &attachmentCacheStats.fileBytes : &attachmentCacheStats.bytes;
+    size_t limit = file ? attachmentFileLimit : attachmentCacheLimit;
+    AttachmentCacheEntry *entry = attachmentCacheTail;
+
+    while (entry && *bytes + length > limit)
+    {
+        AttachmentCacheEntry *prev = entry->prev;
+
+        if ((entry->fd >= 0) == file)
+        {
+            attachment_cache_unlink(entry);
+            entry->references++;
+            attachment_cache_unref(entry);
+        }
+
+        entry = prev;
+    }
+}
+
+void smtp_attachment_cache_configure(size_t maxBytes)
+{
+    pthread_mutex_lock(&attachmentCacheLock);
+    attachmentCacheLimit = maxBytes;
+    attachment_cache_trim(0, 0);
+    pthread_mutex_unlock(&attachmentCacheLock);
+}
+
+// An empty file in directory that is gone once closed
+static int attachment_file_create(const char *directory)
+{
+    char path[sizeof(attachmentFileDirectory) + 32];
+
+    snprintf(path, sizeof(path), "%s/smtp-attachment-XXXXXX", directory);
+
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return -1;
+
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+int smtp_attachment_sendfile_configure(const char *directory, size_t maxBytes)
+{
+    if (directory && maxBytes)
+    {
+        if (strlen(directory) >= sizeof(attachmentFileDirectory))
+            return -1;
+
+        int fd = attachment_file_create(directory);
+        if (fd < 0)
+            return -1;
+
+        close(fd);
+    }
+    else
+        maxBytes = 0;
+
+    pthread_mutex_lock(&attachmentCacheLock);
+    attachmentFileLimit = maxBytes;
+    if (maxBytes)
+        strcpy(attachmentFileDirectory, directory);
+    attachment_cache_trim(0, 1);
+    pthread_mutex_unlock(&attachmentCacheLock);
+
+    __atomic_store_n(&tlsKernelOffload, maxBytes != 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void smtp_attachment_cache_get_stats(SMTPAttachmentCacheStats *stats)
+{
+    pthread_mutex_lock(&attachmentCacheLock);
+    *stats = attachmentCacheStats;
+    pthread_mutex_unlock(&attachmentCacheLock);
+}
+
+// Returns a referenced entry for the file, or NULL when it is not cached
+static AttachmentCacheEntry* attachment_cache_find(const char *path, struct stat *info)
+{
+    AttachmentCacheEntry *found = NULL;
+
+    pthread_mutex_lock(&attachmentCacheLock);
+
+    if (attachmentCacheLimit || attachmentFileLimit)
+    {
+        for (AttachmentCacheEntry *entry = attachmentCacheHead; entry; entry = entry->next) {
+            if (entry->size == info->st_size && entry->mtime.tv_sec == info->st_mtim.tv_sec
+                && entry->mtime.tv_nsec == info->st_mtim.tv_nsec && strcmp(entry->path, path) == 0)
+            {
+                found = entry;
+                break;
+            }
+        }
+
+        if (found)
+        {
+            attachment_cache_unlink(found);
+            attachment_cache_push(found);
+            found->references++;
+            attachmentCacheStats.hits++;
+        }
+        else
+            attachmentCacheStats.misses++;
+    }
+
+    pthread_mutex_unlock(&attachmentCacheLock);
+    return found;
+}
+
+// Encodes a whole mapped file into a new entry that is not cached. Returns a
+// referenced entry, or NULL when memory runs out.
+static AttachmentCacheEntry* attachment_encode(const char *path, struct stat *info, const unsigned char *map)
+{
+    size_t length = smtp_base64_encoded_length(info->st_size, 1);
+
+    if (strlen(path) >= sizeof(((AttachmentCacheEntry*)0)->path))
+        return NULL;
+
+    AttachmentCacheEntry *entry = smtp_calloc(1, sizeof(AttachmentCacheEntry));
+    if (!entry)
+        return NULL;
+
+    entry->data = smtp_malloc(length);
+    if (!entry->data)
+    {
+        free(entry);
+        return NULL;
+    }
+
+    uint64_t started = metrics_now();
+
+    strcpy(entry->path, path);
+    entry->size = info->st_size;
+    entry->mtime = info->st_mtim;
+    entry->fd = -1;
+    entry->length = smtp_base64_encode(entry->data, map, info->st_size, 1);
+    entry->references = 1;
+    metrics_record(SMTP_PHASE_ENCODE, started, info->st_size);
+    return entry;
+}
+
+// Encodes a whole mapped file into a new entry and caches it when it fits.
+// Returns a referenced entry, or NULL when the file should be streamed.
+static AttachmentCacheEntry* attachment_cache_insert(const char *path, struct stat *info, const unsigned char *map)
+{
+    size_t length = smtp_base64_encoded_length(info->st_size, 1);
+
+    pthread_mutex_lock(&attachmentCacheLock);
+    size_t limit = attachmentCacheLimit;
+    pthread_mutex_unlock(&attachmentCacheLock);
+
+    if (length > limit)
+        return NULL;
+
+    AttachmentCacheEntry *entry = attachment_encode(path, info, map);
+    if (!entry)
+        return NULL;
+
+    pthread_mutex_lock(&attachmentCacheLock);
+
+    // The limit may have shrunk while encoding
+    if (entry->length <= attachmentCacheLimit)
+    {
+        attachment_cache_trim(entry->length, 0);
+        attachment_cache_push(entry);
+    }
+
+    pthread_mutex_unlock(&attachmentCacheLock);
+    return entry;
+}
+
+static int attachment_file_write(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        long ret = write(fd, data, length);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret <= 0)
+            return -1;
+
+        data += ret;
+        length -= ret;
+    }
+
+    return 0;
+}
+
+// Encodes a whole mapped file into an unlinked file, a block of lines at a
+// time, and caches it when it fits. Returns a referenced entry, or NULL when
+// the file should be streamed.
+static AttachmentCacheEntry* attachment_file_insert(const char *path, struct stat *info, const unsigned char *map)
+{
+    size_t length = smtp_base64_encoded_length(info->st_size, 1);
+    char directory[sizeof(attachmentFileDirectory)];
+
+    pthread_mutex_lock(&attachmentCacheLock);
+    size_t limit = attachmentFileLimit;
+    strcpy(directory, attachmentFileDirectory);
+    pthread_mutex_unlock(&attachmentCacheLock);
+
+    if (length > limit || strlen(path) >= sizeof(((AttachmentCacheEntry*)0)->path))
+        return NULL;
+
+    AttachmentCacheEntry *entry = smtp_calloc(1, sizeof(AttachmentCacheEntry));
+    char *block = smtp_malloc(4 * MESSAGE_WRITER_CHUNK);
+    int fd = attachment_file_create(directory);
+
+    if (!entry || !block || fd < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+
+        free(block);
+        free(entry);
+        return NULL;
+    }
+
+    uint64_t started = metrics_now();
+    size_t blockLength = 4 * MESSAGE_WRITER_CHUNK / 78 * BASE64_LINE_INPUT;
+
+    for (off_t offset = 0; offset < info->st_size; offset += blockLength)
+    {
+        size_t input = info->st_size - offset < (off_t)blockLength ? (size_t)(info->st_size - offset) : blockLength;
+        size_t written = smtp_base64_encode(block, map + offset, input, 1);
+
+        if (attachment_file_write(fd, block, written))
+        {
+            close(fd);
+            free(block);
+            free(entry);
+            return NULL;
+        }
+
+        entry->length += written;
+    }
+
+    free(block);
+    metrics_record(SMTP_PHASE_ENCODE, started, info->st_size);
+
+    strcpy(entry->path, path);
+    entry->size = info->st_size;
+    entry->mtime = info->st_mtim;
+    entry->fd = fd;
+    entry->references = 1;
+
+    pthread_mutex_lock(&attachmentCacheLock);
+
+    if (entry->length <= attachmentFileLimit)
+    {
+        attachment_cache_trim(entry->length, 1);
+        attachment_cache_push(entry);
+    }
+
+    pthread_mutex_unlock(&attachmentCacheLock);
+    return entry;
+}
+
+// Copies part of an encoded file, for transports that cannot take the file
+static long attachment_file_read(AttachmentCacheEntry *entry, char *dest, size_t length, size_t offset)
+{
+    for (;;)
+    {
+        long ret = pread(entry->fd, dest, length, offset);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        return ret > 0 ? ret : -1;
+    }
+}
+
+static void attachment_cache_release(AttachmentCacheEntry *entry)
+{
+    pthread_mutex_lock(&attachmentCacheLock);
+    attachment_cache_unref(entry);
+    pthread_mutex_unlock(&attachmentCacheLock);
+}
+
+// Attachments encoded ahead on a small thread pool while the sending thread
+// is busy writing what comes before them. Each writer queues the attachments
+// it will send next, in order, as long as their encoded size fits the limit
+// shared by all writers; the sending thread takes every result in list order
+// and does the work itself for any attachment no worker started yet, so it
+// never waits longer than encoding in place would take.
+enum
+{
+    ENCODE_IDLE,
+    ENCODE_QUEUED,
+    ENCODE_RUNNING,
+    ENCODE_DONE
+};
+
+typedef struct EncodeJob EncodeJob;
+struct EncodeJob
+{
+    Attachement *attachement;       // NULL when it is not worth encoding ahead
+    off_t size;                     // of the file when it was queued
+    size_t reserved;                // encoded bytes counted against the limit
+    int state;
+    AttachmentCacheEntry *entry;    // the result, NULL when encoding failed
+    EncodeJob *next;
+};
+
+static pthread_mutex_t encoderLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t encoderConfigureLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t encoderWork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t encoderDone = PTHREAD_COND_INITIALIZER;
+static pthread_t *encoderThreads;
+static int encoderThreadCount;
+static int encoderStop;
+static size_t encoderLimit;
+static EncodeJob *encoderHead;
+static EncodeJob *encoderTail;
+static SMTPAttachmentEncoderStats encoderStats;
+
+// Encodes a file from the cache or a mapping of its own. The file must still
+// have the size it was queued with, or the reservation would not hold.
+static AttachmentCacheEntry* encoder_encode(const char *path, off_t size)
+{
+    struct stat info;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &info) || !S_ISREG(info.st_mode) || info.st_size != size)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    AttachmentCacheEntry *entry = attachment_cache_find(path, &info);
+    if (entry)
+    {
+        close(fd);
+        return entry;
+    }
+
+    void *map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return NULL;
+
+    madvise(map, info.st_size, MADV_SEQUENTIAL);
+
+    entry = attachment_cache_insert(path, &info, map);
+    if (!entry)
+        entry = attachment_encode(path, &info, map);
+
+    munmap(map, info.st_size);
+    return entry;
+}
+
+static void* encoder_worker(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&encoderLock);
+
+    for (;;)
+    {
+        while (!encoderHead && !encoderStop)
+            pthread_cond_wait(&encoderWork, &encoderLock);
+
+        if (encoderStop)
+            break;
+
+        EncodeJob *job = encoderHead;
+
+        encoderHead = job->next;
+        if (!encoderHead)
+            encoderTail = NULL;
+
+        job->next = NULL;
+        job->state = ENCODE_RUNNING;
+        pthread_mutex_unlock(&encoderLock);
+
+        // The writer waits for running jobs before it lets go of them
+        AttachmentCacheEntry *entry = encoder_encode(job->attachement->filePath.data, job->size);
+
+        pthread_mutex_lock(&encoderLock);
+        job->entry = entry;
+        job->state = ENCODE_DONE;
+
+        // The sender encodes it itself then
+        if (entry)
+            encoderStats.encoded++;
+        else
+            encoderStats.failed++;
+        pthread_cond_broadcast(&encoderDone);
+    }
+
+    pthread_mutex_unlock(&encoderLock);
+    return NULL;
+}
+
+// Called with the lock held
+static void encoder_unqueue(EncodeJob *job)
+{
+    EncodeJob **link = &encoderHead;
+    EncodeJob *prev = NULL;
+
+    while (*link != job)
+    {
+        prev = *link;
+        link = &(*link)->next;
+    }
+
+    *link = job->next;
+    if (encoderTail == job)
+        encoderTail = prev;
+
+    job->next = NULL;
+    job->state = ENCODE_IDLE;
+}
+
+// Called with the lock held
+static void encoder_unreserve(EncodeJob *job)
+{
+    encoderStats.bytes -= job->reserved;
+    job->reserved = 0;
+}
+
+int smtp_attachment_encoder_configure(int threads, size_t maxBytes)
+{
+    pthread_mutex_lock(&encoderConfigureLock);
+
+    // Running jobs finish first; queued ones wait for the new threads or are
+    // taken over by their writers
+    pthread_mutex_lock(&encoderLock);
+    encoderStop = 1;
+    pthread_cond_broadcast(&encoderWork);
+    pthread_mutex_unlock(&encoderLock);
+
+    for (int i = 0; i < encoderThreadCount; i++)
+        pthread_join(encoderThreads[i], NULL);
+
+    free(encoderThreads);
+    encoderThreads = NULL;
+
+    pthread_mutex_lock(&encoderLock);
+    encoderStop = 0;
+    encoderThreadCount = 0;
+    encoderLimit = threads > 0 ? maxBytes : 0;
+    pthread_mutex_unlock(&encoderLock);
+
+    int result = 0;
+
+    if (threads > 0 && maxBytes > 0)
+    {
+        encoderThreads = smtp_calloc(threads, sizeof(pthread_t));
+        if (!encoderThreads)
+            result = -1;
+
+        while (encoderThreads && encoderThreadCount < threads)
+        {
+            if (pthread_create(&encoderThreads[encoderThreadCount], NULL, encoder_worker, NULL))
+            {
+                result = -1;
+                break;
+            }
+
+            encoderThreadCount++;
+        }
+
+        // Without a thread nothing would ever run what gets queued
+        pthread_mutex_lock(&encoderLock);
+        if (!encoderThreadCount)
+            encoderLimit = 0;
+
+        // Whatever was left in the queue belongs to the new threads
+        pthread_cond_broadcast(&encoderWork);
+        pthread_mutex_unlock(&encoderLock);
+    }
+
+    pthread_mutex_unlock(&encoderConfigureLock);
+    return result;
+}
+
+void smtp_attachment_encoder_get_stats(SMTPAttachmentEncoderStats *stats)
+{
+    pthread_mutex_lock(&encoderLock);
+    *stats = encoderStats;
+    pthread_mutex_unlock(&encoderLock);
+}
+
+// Text types may skip base64 when their content allows it
+static int mime_is_text(const char *type)
+{
+    return strncmp(type, "text/", 5) == 0 || strcmp(type, "application/json") == 0 || strcmp(type, "application/xml") == 0;
+}
+
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_HIGHS 0x8080808080808080ULL
+
+// Nonzero when one of the eight bytes in word equals byte
+static uint64_t swar_has_byte(uint64_t word, unsigned char byte)
+{
+    uint64_t x = word ^ (SWAR_ONES * byte);
+    return (x - SWAR_ONES) & ~x & SWAR_HIGHS;
+}
+
+// Whether data can be sent as a text part without encoding: no NUL, no CR
+// outside a CRLF, no line longer than the 998 octets SMTP allows, and 8-bit
+// bytes only with allow8bit. *eightBit reports whether any were found.
+// Runs of eight plain bytes are skipped a word at a time.
+static int text_part_allowed(const unsigned char *data, size_t length, int allow8bit, int *eightBit)
+{
+    size_t lineStart = 0;
+    uint64_t high = 0;
+    size_t i = 0;
+
+    while (i < length)
+    {
+        if (i + 8 <= length)
+        {
+            uint64_t word;
+            memcpy(&word, data + i, sizeof(word));
+
+            if (!(swar_has_byte(word, '\n') | swar_has_byte(word, '\r') | swar_has_byte(word, 0)))
+            {
+                high |= word & SWAR_HIGHS;
+                i += 8;
+
+                if (i - lineStart > 998)
+                    return 0;
+
+                continue;
+            }
+        }
+
+        unsigned char c = data[i];
+
+        if (c == '\n')
+        {
+            size_t lineLength = i - lineStart;
+
+            if (lineLength && data[i - 1] == '\r')
+                lineLength--;
+
+            if (lineLength > 998)
+                return 0;
+
+            lineStart = i + 1;
+        }
+        else if (c == 0 || (c == '\r' && (i + 1 == length || data[i + 1] != '\n')))
+            return 0;
+        else
+            high |= c & 0x80;
+
+        i++;
+    }
+
+    if (length - lineStart > 998 || (high && !allow8bit))
+        return 0;
+
+    *eightBit = high != 0;
+    return 1;
+}
+
+// Copies whole lines of a text part, ending each with CRLF. With stuffDots a
+// leading dot is doubled so no line can end a DATA block; BDAT needs no
+// stuffing. Lines are known to be at most 998 octets. The line break before
+// the next boundary belongs to the boundary, so a final newline in the file
+// is written out twice.
+static size_t text_part_copy(const unsigned char *data, size_t length, size_t *offset, char *dest, size_t capacity, int stuffDots)
+{
+    size_t written = 0;
+
+    while (*offset < length && capacity - written >= 1003)
+    {
+        const unsigned char *line = data + *offset;
+        size_t available = length - *offset;
+        const unsigned char *newline = memchr(line, '\n', available);
+        size_t consumed = newline ? (size_t)(newline - line) + 1 : available;
+        size_t lineLength = newline ? (size_t)(newline - line) : available;
+
+        if (lineLength && line[lineLength - 1] == '\r')
+            lineLength--;
+
+        if (stuffDots && lineLength && line[0] == '.')
+            dest[written++] = '.';
+
+        memcpy(dest + written, line, lineLength);
+        written += lineLength;
+        dest[written++] = '\r';
+        dest[written++] = '\n';
+        *offset += consumed;
+
+        if (*offset == length && newline)
+        {
+            dest[written++] = '\r';
+            dest[written++] = '\n';
+        }
+    }
+
+    return written;
+}
+
+// The most a text part can take on the wire: raw, bare line feeds become CRLF,
+// leading dots are doubled and a final newline is written twice; otherwise
+// it is base64-encoded
+static size_t text_part_length(const unsigned char *data, size_t length)
+{
+    size_t raw = length + 2;
+    size_t encoded = smtp_base64_encoded_length(length, 1);
+
+    if (length && data[0] == '.')
+        raw++;
+
+    for (const unsigned char *p = data; (p = memchr(p, '\n', data + length - p)); p++)
+    {
+        if (p == data || p[-1] != '\r')
+            raw++;
+
+        if (p + 1 < data + length && p[1] == '.')
+            raw++;
+    }
+
+    return raw > encoded ? raw : encoded;
+}
+
+// How the body part is sent: raw when it is plain ASCII or the server takes
+// 8-bit data, base64 otherwise
+static const char* body_transfer_encoding(SMTPString *body, int capabilities)
+{
+    int eightBit = 0;
+
+    if (!text_part_allowed((const unsigned char*)body->data, body->length, capabilities & CAPABILITY_8BITMIME, &eightBit))
+        return "base64";
+
+    return eightBit ? "8bit" : "7bit";
+}
+
+enum
+{
+    WRITER_HEADERS,
+    WRITER_TO,
+    WRITER_CC,
+    WRITER_BODY,
+    WRITER_BODY_DATA,
+    WRITER_ATTACHMENT_HEADER,
+    WRITER_ATTACHMENT_DATA,
+    WRITER_RENDERED,
+    WRITER_CLOSE,
+    WRITER_DONE
+};
+
+// A piece of a rendered message: a copy of what the writer produced, always
+// in whole lines, or an encoded attachment shared with the cache
+typedef struct RenderSegment RenderSegment;
+struct RenderSegment
+{
+    const char *data;
+    size_t length;
+    AttachmentCacheEntry *entry;    // referenced while the message lives
+};
+
+// Everything of a message from the MIME-Version header on, rendered once as
+// if for a server that takes neither 8-bit data nor dots left unstuffed, so
+// it suits every server. The headers that depend on the envelope and the
+// moment of sending come in front of it for each send.
+struct SMTPRenderedMessage
+{
+    SMTPArena arena;
+    RenderSegment *segments;
+    int segmentCount;
+    int segmentCapacity;
+    size_t length;
+};
+
+// Produces the DATA content of a message a piece at a time, so it can be
+// streamed from the blocking session as well as from the event loop without
+// ever holding a whole attachment in memory. Attachments are mapped and
+// base64-encoded straight from the mapping one block at a time, or copied
+// from the attachment cache when it already holds them, or taken encoded
+// from the attachment encoder. Text attachments the server can take as they
+// are skip the encoding.
+typedef struct MessageWriter MessageWriter;
+struct MessageWriter
+{
+    MailMessage *message;
+    const char *from;
+    int capabilities;
+    int stuffDots;                  // sent with DATA rather than BDAT
+    int enableLogs;
+    int stage;
+    int addresses;                  // addresses written to the current header
+    RecipientListNode *recipient;
+    AttachementListNode *attachment;
+    const unsigned char *map;       // the body, or a mapped attachment
+    size_t mapLength;
+    AttachmentCacheEntry *cached;
+    size_t offset;                  // into the mapping or the cached encoding
+    int textPart;                   // the mapping goes out unencoded
+    int eightBit;
+    size_t produced;                // bytes of content so far
+    SMTPRenderedMessage *rendered;  // sent after the headers instead of the message
+    int segment;
+    EncodeJob *jobs;                // one per attachment while encoding ahead
+    int jobIndex;                   // of the current attachment
+    int nextJob;                    // first one not queued yet
+    char boundary[40];              // random, as text parts go out raw
+};
+
+// Queues the attachments from index from on as long as their encoded size
+// fits; the rest wait for the next attachment to free some room
+static void message_writer_schedule(MessageWriter *writer, int from)
+{
+    int count = writer->message->attachementList.numberOfElements;
+    int queued = 0;
+
+    if (writer->nextJob < from)
+        writer->nextJob = from;
+
+    pthread_mutex_lock(&encoderLock);
+
+    while (writer->nextJob < count)
+    {
+        EncodeJob *job = &writer->jobs[writer->nextJob];
+
+        if (job->attachement)
+        {
+            if (encoderStats.bytes + job->reserved > encoderLimit)
+                break;
+
+            encoderStats.bytes += job->reserved;
+            job->state = ENCODE_QUEUED;
+
+            if (encoderTail)
+                encoderTail->next = job;
+            else
+                encoderHead = job;
+
+            encoderTail = job;
+            queued = 1;
+        }
+
+        writer->nextJob++;
+    }
+
+    if (queued)
+        pthread_cond_broadcast(&encoderWork);
+
+    pthread_mutex_unlock(&encoderLock);
+}
+
+static void message_writer_start_jobs(MessageWriter *writer, SMTPArena *arena)
+{
+    MailMessage *message = writer->message;
+
+    pthread_mutex_lock(&encoderLock);
+    size_t limit = encoderLimit;
+    pthread_mutex_unlock(&encoderLock);
+
+    if (!limit || !message->attachementList.numberOfElements)
+        return;
+
+    size_t size = message->attachementList.numberOfElements * sizeof(EncodeJob);
+
+    writer->jobs = arena_alloc(arena, size);
+    if (!writer->jobs)
+        return;
+
+    memset(writer->jobs, 0, size);
+
+    // Text files may go out as they are, and empty ones have nothing to encode
+    int i = 0;
+    for (AttachementListNode *node = message->attachementList.head; node; node = node->next, i++)
+    {
+        EncodeJob *job = &writer->jobs[i];
+        struct stat info;
+
+        if (mime_is_text(get_mime_type(node->attachement.fileName.data)))
+            continue;
+
+        if (stat(node->attachement.filePath.data, &info) || !S_ISREG(info.st_mode) || info.st_size == 0)
+            continue;
+
+        job->reserved = smtp_base64_encoded_length(info.st_size, 1);
+        if (job->reserved > limit)
+        {
+            job->reserved = 0;
+            continue;
+        }
+
+        job->attachement = &node->attachement;
+        job->size = info.st_size;
+    }
+
+    message_writer_schedule(writer, 0);
+}
+
+// Returns the encoding of the current attachment when a worker made it, or
+// NULL when the writer has to produce it itself
+static AttachmentCacheEntry* message_writer_take(MessageWriter *writer)
+{
+    if (!writer->jobs)
+        return NULL;
+
+    EncodeJob *job = &writer->jobs[writer->jobIndex];
+    AttachmentCacheEntry *entry = NULL;
+
+    pthread_mutex_lock(&encoderLock);
+
+    if (job->state == ENCODE_QUEUED)
+    {
+        encoder_unqueue(job);
+        encoder_unreserve(job);
+        encoderStats.inlined++;
+    }
+    else if (job->state != ENCODE_IDLE)
+    {
+        if (job->state == ENCODE_RUNNING)
+            encoderStats.waits++;
+
+        while (job->state == ENCODE_RUNNING)
+            pthread_cond_wait(&encoderDone, &encoderLock);
+
+        // The reservation holds until the attachment was sent
+        entry = job->entry;
+        job->entry = NULL;
+        if (!entry)
+            encoder_unreserve(job);
+    }
+
+    pthread_mutex_unlock(&encoderLock);
+
+    message_writer_schedule(writer, writer->jobIndex + 1);
+    return entry;
+}
+
+// Done with the current attachment: its reservation makes room for the next
+static void message_writer_advance(MessageWriter *writer)
+{
+    if (writer->jobs)
+    {
+        pthread_mutex_lock(&encoderLock);
+        encoder_unreserve(&writer->jobs[writer->jobIndex]);
+        pthread_mutex_unlock(&encoderLock);
+
+        message_writer_schedule(writer, writer->jobIndex + 1);
+    }
+
+    writer->attachment = writer->attachment->next;
+    writer->jobIndex++;
+}
+
+// Takes back every job the writer still has out, waiting for running ones
+static void message_writer_stop_jobs(MessageWriter *writer)
+{
+    if (!writer->jobs)
+        return;
+
+    int count = writer->message->attachementList.numberOfElements;
+
+    pthread_mutex_lock(&encoderLock);
+
+    for (int i = 0; i < count; i++)
+    {
+        EncodeJob *job = &writer->jobs[i];
+
+        if (job->state == ENCODE_QUEUED)
+            encoder_unqueue(job);
+
+        while (job->state == ENCODE_RUNNING)
+            pthread_cond_wait(&encoderDone, &encoderLock);
+
+        if (job->entry)
+        {
+            // The encoder lock is always taken before the cache lock
+            attachment_cache_release(job->entry);
+            job->entry = NULL;
+        }
+
+        encoder_unreserve(job);
+    }
+
+    pthread_mutex_unlock(&encoderLock);
+
+    writer->jobs = NULL;
+}
+
+// A multipart boundary no text part sent as it is can be expected to contain
+static void message_boundary(char *boundary)
+{
+    static const char digits[] = "0123456789abcdef";
+    static unsigned long sequence;
+    unsigned char bytes[16];
+
+    // Without the random generator time, process and a counter stand in
+    if (RAND_bytes(bytes, sizeof(bytes)) != 1)
+    {
+        struct timespec ts;
+        uint64_t values[2];
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        values[0] = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        values[1] = (uint64_t)getpid() << 32 ^ __atomic_add_fetch(&sequence, 1, __ATOMIC_RELAXED);
+        memcpy(bytes, values, sizeof(bytes));
+    }
+
+    memcpy(boundary, "=_", 2);
+
+    for (size_t i = 0; i < sizeof(bytes); i++)
+    {
+        boundary[2 + 2 * i] = digits[bytes[i] >> 4];
+        boundary[3 + 2 * i] = digits[bytes[i] & 15];
+    }
+
+    boundary[2 + 2 * sizeof(bytes)] = 0;
+}
+
+// The encoder's jobs for the message come from arena, which must outlive the
+// writer
+static void message_writer_init(MessageWriter *writer, MailMessage *message, SMTPRenderedMessage *rendered, SMTPArena *arena,
+                                const char *from, int capabilities, int enableLogs)
+{
+    memset(writer, 0, sizeof(MessageWriter));
+    writer->message = message;
+    writer->rendered = rendered;
+    writer->from = from;
+    writer->capabilities = capabilities;
+    writer->stuffDots = !(capabilities & CAPABILITY_CHUNKING);
+    writer->enableLogs = enableLogs;
+    writer->recipient = message->recipientList.head;
+    writer->attachment = message->attachementList.head;
+
+    if (writer->attachment)
+        message_boundary(writer->boundary);
+
+    message_writer_start_jobs(writer, arena);
+}
+
+static void message_writer_unmap(MessageWriter *writer)
+{
+    if (writer->map)
+    {
+        munmap((void*)writer->map, writer->mapLength);
+        writer->map = NULL;
+    }
+
+    if (writer->cached)
+    {
+        attachment_cache_release(writer->cached);
+        writer->cached = NULL;
+    }
+
+    writer->mapLength = 0;
+    writer->offset = 0;
+    writer->textPart = 0;
+}
+
+static void message_writer_close(MessageWriter *writer)
+{
+    message_writer_unmap(writer);
+    message_writer_stop_jobs(writer);
+}
+
+// Prepares the current attachment for streaming: encoded ahead by the
+// encoder, as a text part straight from a private read-only mapping, from the
+// cache, or base64-encoded from the mapping
+static int message_writer_prepare(MessageWriter *writer, Attachement *attachement)
+{
+    const char *path = attachement->filePath.data;
+    int text = mime_is_text(get_mime_type(attachement->fileName.data));
+    struct stat info;
+
+    writer->cached = message_writer_take(writer);
+    if (writer->cached)
+        return 0;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &info) || !S_ISREG(info.st_mode))
+    {
+        close(fd);
+        return -1;
+    }
+
+    if (info.st_size > 0 && !text)
+        writer->cached = attachment_cache_find(path, &info);
+
+    if (writer->cached || info.st_size == 0)
+    {
+        writer->textPart = info.st_size == 0 && text;
+        close(fd);
+        return 0;
+    }
+
+    // Like any mapping, a file truncated while it is being sent raises SIGBUS
+    void *map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return -1;
+
+    madvise(map, info.st_size, MADV_SEQUENTIAL);
+    writer->map = map;
+    writer->mapLength = info.st_size;
+
+    if (text)
+    {
+        if (text_part_allowed(writer->map, writer->mapLength, writer->capabilities & CAPABILITY_8BITMIME, &writer->eightBit))
+        {
+            writer->textPart = 1;
+            return 0;
+        }
+
+        writer->cached = attachment_cache_find(path, &info);
+    }
+
+    // Encoded once in full, then served like a hit
+    if (!writer->cached)
+        writer->cached = attachment_cache_insert(path, &info, writer->map);
+
+    if (!writer->cached)
+        writer->cached = attachment_file_insert(path, &info, writer->map);
+
+    if (writer->cached)
+    {
+        munmap(map, info.st_size);
+        writer->map = NULL;
+        writer->mapLength = 0;
+    }
+
+    return 0;
+}
+
+static int message_writer_open(MessageWriter *writer, Attachement *attachement)
+{
+    uint64_t started = metrics_now();
+
+    if (message_writer_prepare(writer, attachement))
+        return -1;
+
+    metrics_record(SMTP_PHASE_ATTACHMENT, started, writer->cached ? (size_t)writer->cached->size : writer->mapLength);
+    return 0;
+}
+
+// Writes as much of the To or Cc header as fits, one address per folded line.
+// Bcc recipients never appear in the headers.
+static size_t message_writer_addresses(MessageWriter *writer, char *dest, size_t capacity, RecipientType type)
+{
+    const char *name = type == RECIPIENT_TO ? "To: " : "Cc: ";
+    size_t length = 0;
+
+    while (writer->recipient && capacity - length > 1100)
+    {
+        Recipient *recipient = &writer->recipient->recipient;
+
+        writer->recipient = writer->recipient->next;
+        if (recipient->type != type)
+            continue;
+
+        length += snprintf(dest + length, capacity - length, "%s<%s>", writer->addresses ? ",\r\n " : name, recipient->emailAdress.data);
+        writer->addresses++;
+    }
+
+    // The header continues in the next piece
+    if (writer->recipient)
+        return length;
+
+    if (writer->addresses)
+        length += snprintf(dest + length, capacity - length, "\r\n");
+    else if (type == RECIPIENT_TO)
+        length += snprintf(dest + length, capacity - length, "To: undisclosed-recipients:;\r\n");
+
+    writer->stage++;
+    writer->addresses = 0;
+    writer->recipient = writer->message->recipientList.head;
+    return length;
+}
+
+// Copies the next lines of a rendered segment. Its lines are no longer than
+// a text part's, so a leading dot always fits in front of them.
+static int message_writer_segment(MessageWriter *writer, char *dest, size_t capacity)
+{
+    RenderSegment *segment = &writer->rendered->segments[writer->segment];
+    size_t written = 0;
+
+    // Base64 never starts a line with a dot
+    if (!writer->stuffDots || segment->entry)
+    {
+        written = segment->length - writer->offset;
+        if (written > capacity)
+            written = capacity;
+
+        if (segment->entry && segment->entry->fd >= 0)
+        {
+            long ret = attachment_file_read(segment->entry, dest, written, writer->offset);
+            if (ret < 0)
+                return -1;
+
+            written = ret;
+        }
+        else
+            memcpy(dest, segment->data + writer->offset, written);
+
+        writer->offset += written;
+        return written;
+    }
+
+    while (writer->offset < segment->length && capacity - written >= 1003)
+    {
+        const char *line = segment->data + writer->offset;
+        size_t available = segment->length - writer->offset;
+        const char *newline = memchr(line, '\n', available);
+        size_t lineLength = newline ? (size_t)(newline - line) + 1 : available;
+
+        if (line[0] == '.')
+            dest[written++] = '.';
+
+        memcpy(dest + written, line, lineLength);
+        written += lineLength;
+        writer->offset += lineLength;
+    }
+
+    return written;
+}
+
+// Moves past the rendered segments already sent
+static void message_writer_skip_segments(MessageWriter *writer)
+{
+    while (writer->segment < writer->rendered->segmentCount
+           && writer->offset == writer->rendered->segments[writer->segment].length)
+    {
+        writer->segment++;
+        writer->offset = 0;
+    }
+}
+
+// Emits the next block of the body or an attachment from its mapping: whole
+// lines of a text part, or base64 lines. Returns 0 once all of it was sent.
+static size_t message_writer_block(MessageWriter *writer, char *dest, size_t capacity)
+{
+    if (writer->offset >= writer->mapLength)
+        return 0;
+
+    if (writer->textPart)
+        return text_part_copy(writer->map, writer->mapLength, &writer->offset, dest, capacity, writer->stuffDots);
+
+    size_t blockLength = capacity / 78 * BASE64_LINE_INPUT;
+
+    if (blockLength > writer->mapLength - writer->offset)
+        blockLength = writer->mapLength - writer->offset;
+
+    uint64_t started = metrics_now();
+    size_t written = smtp_base64_encode(dest, writer->map + writer->offset, blockLength, 1);
+
+    metrics_record(SMTP_PHASE_ENCODE, started, blockLength);
+    writer->offset += blockLength;
+    return written;
+}
+
+static int message_writer_piece(MessageWriter *writer, char *dest, size_t capacity)
+{
+    MailMessage *message = writer->message;
+    size_t length = 0;
+
+    while (length == 0 && writer->stage != WRITER_DONE)
+    {
+        switch (writer->stage)
+        {
+            case WRITER_HEADERS:
+            {
+                char dateStr[128];
+                time_t now = time(NULL);
+                struct tm *tm_info = gmtime(&now);
+
+                strftime(dateStr, sizeof(dateStr), "%a, %d %b %Y %H:%M:%S +0000", tm_info);
+
+                length = snprintf(dest, capacity,
+                            "Date: %s\r\n"
+                            "From: <%s>\r\n",
+                            dateStr,
+                            writer->from);
+                writer->stage = WRITER_TO;
+                break;
+            }
+
+            case WRITER_TO:
+                length = message_writer_addresses(writer, dest, capacity, RECIPIENT_TO);
+                break;
+
+            case WRITER_CC:
+                length = message_writer_addresses(writer, dest, capacity, RECIPIENT_CC);
+                break;
+
+            case WRITER_BODY:
+            {
+                if (writer->rendered)
+                {
+                    static unsigned long sequence;
+                    const char *domain = strrchr(writer->from, '@');
+                    struct timespec ts;
+
+                    clock_gettime(CLOCK_REALTIME, &ts);
+
+                    length = snprintf(dest, capacity, "Message-ID: <%lld.%09ld.%d.%lu@%s>\r\n",
+                                (long long)ts.tv_sec, ts.tv_nsec, (int)getpid(),
+                                __atomic_add_fetch(&sequence, 1, __ATOMIC_RELAXED),
+                                domain ? domain + 1 : "localhost");
+                    writer->stage = WRITER_RENDERED;
+                    break;
+                }
+
+                const char *encoding = body_transfer_encoding(&message->body, writer->capabilities);
+
+                // Streamed like an attachment, in whole lines or base64 lines
+                writer->map = (const unsigned char*)message->body.data;
+                writer->mapLength = message->body.length;
+                writer->offset = 0;
+                writer->textPart = strcmp(encoding, "base64") != 0;
+
+                if (!message->attachementList.numberOfElements)
+                {
+                    length = snprintf(dest, capacity,
+                                "MIME-Version: 1.0\r\n"
+                                "Content-Type: text/%s; charset=\"ISO-8859-1\"\r\n"
+                                "Content-Transfer-Encoding: %s\r\n"
+                                "Subject: %s\r\n\r\n",
+                                message->isBodyHtml? "html" : "plain",
+                                encoding,
+                                message->subject.data);
+                    writer->stage = WRITER_BODY_DATA;
+                    break;
+                }
+
+                length = snprintf(dest, capacity,
+                            "MIME-Version: 1.0\r\n"
+                            "Content-Type: multipart/mixed; boundary=\"%s\"\r\n"
+                            "Subject: %s\r\n\r\n"
+                            "--%s\r\n"
+                            "Content-Type: text/%s; charset=\"ISO-8859-1\"\r\n"
+                            "Content-Transfer-Encoding: %s\r\n\r\n",
+                            writer->boundary,
+                            message->subject.data,
+                            writer->boundary,
+                            message->isBodyHtml? "html" : "plain",
+                            encoding);
+                writer->stage = WRITER_BODY_DATA;
+                break;
+            }
+
+            case WRITER_BODY_DATA:
+                length = message_writer_block(writer, dest, capacity);
+                if (length)
+                    break;
+
+                // The body is not mapped, so nothing is unmapped here
+                writer->map = NULL;
+                writer->mapLength = 0;
+                writer->offset = 0;
+                writer->textPart = 0;
+
+                if (!message->attachementList.numberOfElements)
+                {
+                    writer->stage = WRITER_DONE;
+                    break;
+                }
+
+                length = snprintf(dest, capacity, "\r\n");
+                writer->stage = WRITER_ATTACHMENT_HEADER;
+                break;
+
+            case WRITER_ATTACHMENT_HEADER:
+            {
+                Attachement *attachement = &writer->attachment->attachement;
+
+                if (message_writer_open(writer, attachement))
+                    return -1;
+
+                length = snprintf(dest, capacity,
+                            "--%s\r\n"
+                            "Content-Disposition: attachment; filename=\"%s\"\r\n"
+                            "Content-Type: %s; name=\"%s\"\r\n"
+                            "Content-Transfer-Encoding: %s\r\n\r\n",
+                            writer->boundary,
+                            attachement->fileName.data,
+                            attachment_mime_type(attachement->fileName.data, attachement->filePath.data),
+                            attachement->fileName.data,
+                            writer->textPart ? (writer->eightBit ? "8bit" : "7bit") : "base64");
+                writer->stage = WRITER_ATTACHMENT_DATA;
+                break;
+            }
+
+            case WRITER_ATTACHMENT_DATA:
+            {
+                if (writer->cached && writer->offset < writer->cached->length)
+                {
+                    size_t copy = writer->cached->length - writer->offset;
+
+                    if (copy > capacity)
+                        copy = capacity;
+
+                    if (writer->cached->fd >= 0)
+                    {
+                        long ret = attachment_file_read(writer->cached, dest, copy, writer->offset);
+                        if (ret < 0)
+                            return -1;
+
+                        copy = ret;
+                    }
+                    else
+                        memcpy(dest, writer->cached->data + writer->offset, copy);
+
+                    writer->offset += copy;
+                    return copy;
+                }
+
+                if (writer->map && writer->offset < writer->mapLength)
+                    return message_writer_block(writer, dest, capacity);
+
+                message_writer_unmap(writer);
+                message_writer_advance(writer);
+                writer->stage = writer->attachment ? WRITER_ATTACHMENT_HEADER : WRITER_CLOSE;
+                break;
+            }
+
+            case WRITER_RENDERED:
+                message_writer_skip_segments(writer);
+
+                if (writer->segment == writer->rendered->segmentCount)
+                {
+                    writer->stage = WRITER_DONE;
+                    break;
+                }
+
+                return message_writer_segment(writer, dest, capacity);
+
+            case WRITER_CLOSE:
+                length = snprintf(dest, capacity, "--%s--\r\n", writer->boundary);
+                writer->stage = WRITER_DONE;
+                break;
+        }
+    }
+
+    if (writer->enableLogs && length)
+        log_protocol(SMTP_LOG_CLIENT, dest, length, 0);
+
+    return length;
+}
+
+// Fills dest with the next piece of the message. capacity must be at least
+// MESSAGE_WRITER_CHUNK. Returns the number of bytes written, 0 once the
+// whole message has been produced, or -1 when an attachment cannot be read.
+static int message_writer_next(MessageWriter *writer, char *dest, size_t capacity)
+{
+    int length = message_writer_piece(writer, dest, capacity);
+
+    if (length > 0)
+        writer->produced += length;
+
+    return length;
+}
+
+// The encoded file the writer is about to copy from, when the transport can
+// send it directly instead. *offset and *length receive the part left.
+static AttachmentCacheEntry* message_writer_file(MessageWriter *writer, Transport *transport, off_t *offset, size_t *length)
+{
+    AttachmentCacheEntry *entry = NULL;
+
+    if (writer->stage == WRITER_ATTACHMENT_DATA)
+        entry = writer->cached;
+    else if (writer->stage == WRITER_RENDERED)
+    {
+        message_writer_skip_segments(writer);
+
+        if (writer->segment < writer->rendered->segmentCount)
+            entry = writer->rendered->segments[writer->segment].entry;
+    }
+
+    if (!entry || entry->fd < 0 || writer->offset >= entry->length || !transport || !transport_can_sendfile(transport))
+        return NULL;
+
+    *offset = writer->offset;
+    *length = entry->length - writer->offset;
+    return entry;
+}
+
+// The rest of that file went out with sendfile()
+static void message_writer_file_sent(MessageWriter *writer, size_t length)
+{
+    writer->offset += length;
+    writer->produced += length;
+
+    pthread_mutex_lock(&attachmentCacheLock);
+    attachmentCacheStats.sendfileBytes += length;
+    pthread_mutex_unlock(&attachmentCacheLock);
+}
+
+// Fills dest with as much of the message as fits in capacity bytes for one
+// BDAT chunk, stopping early at an encoded file transport can send itself
+// (NULL never can). *last is set once the whole message has been produced.
+static int message_writer_fill(MessageWriter *writer, Transport *transport, char *dest, size_t capacity, size_t *length, int *last)
+{
+    off_t fileOffset;
+    size_t fileLength;
+
+    *length = 0;
+    *last = 0;
+
+    while (capacity - *length >= MESSAGE_WRITER_CHUNK && !message_writer_file(writer, transport, &fileOffset, &fileLength))
+    {
+        int written = message_writer_next(writer, dest + *length, capacity - *length);
+        if (written < 0)
+            return -1;
+
+        if (written == 0)
+        {
+            *last = 1;
+            break;
+        }
+
+        *length += written;
+    }
+
+    return 0;
+}
+
+// Writes "BDAT <length>" into the first BDAT_HEADER_SIZE bytes of buffer so
+// that it ends where the chunk begins, and returns the offset it starts at
+static size_t bdat_header(char *buffer, size_t length, int last, int enableLogs)
+{
+    char header[BDAT_HEADER_SIZE];
+    int headerLength = snprintf(header, sizeof(header), "BDAT %zu%s\r\n", length, last ? " LAST" : "");
+
+    if (enableLogs)
+        log_protocol(SMTP_LOG_CLIENT, header, headerLength, 0);
+
+    memcpy(buffer + BDAT_HEADER_SIZE - headerLength, header, headerLength);
+    return BDAT_HEADER_SIZE - headerLength;
+}
+
+// Adds what a text attachment can take on the wire to estimate
+static int text_file_length(const char *path, size_t *estimate)
+{
+    struct stat info;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &info) || !S_ISREG(info.st_mode))
+    {
+        close(fd);
+        return -1;
+    }
+
+    if (info.st_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    void *map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return -1;
+
+    *estimate += text_part_length(map, info.st_size);
+    munmap(map, info.st_size);
+    return 0;
+}
+
+// Every attachment must be readable before the transaction starts, since a
+// message cannot be abandoned half way through DATA. *estimate receives the
+// approximate size of the message for the SIZE extension, counting text
+// parts as they would go out raw and everything else base64-encoded.
+static int message_check_attachments(MailMessage *message, size_t *estimate)
+{
+    AttachementListNode* current = message->attachementList.head;
+    struct stat info;
+
+    // Headers, MIME boundaries and the body, raw or base64-encoded
+    *estimate = 2048 + message->subject.length + text_part_length((const unsigned char*)message->body.data, message->body.length);
+
+    for (RecipientListNode* node = message->recipientList.head; node; node = node->next)
+        *estimate += node->recipient.emailAdress.length + 4;
+
+    for (int i = 0; i < message->attachementList.numberOfElements; i++)
+    {
+        Attachement *attachement = &current->attachement;
+
+        if (access(attachement->filePath.data, R_OK) || stat(attachement->filePath.data, &info))
+            return -1;
+
+        if (mime_is_text(get_mime_type(attachement->fileName.data)))
+        {
+            if (text_file_length(attachement->filePath.data, estimate))
+                return -1;
+
+            *estimate += 512;
+        }
+        else
+            *estimate += 512 + smtp_base64_encoded_length(info.st_size, 1);
+
+        current = current->next;
+    }
+
+    return 0;
+}
+
+static int address_is_ascii(const char *address)
+{
+    for (; *address; address++) {
+        if ((unsigned char)*address & 0x80)
+            return 0;
+    }
+
+    return 1;
+}
+
+static int message_is_ascii(const char *from, MailMessage *message)
+{
+    if (!address_is_ascii(from))
+        return 0;
+
+    for (RecipientListNode* current = message->recipientList.head; current; current = current->next) {
+        if (!address_is_ascii(current->recipient.emailAdress.data))
+            return 0;
+    }
+
+    return 1;
+}
+
+// Builds MAIL FROM with the parameters the server announced: the size of the
+// message, BODY=8BITMIME and SMTPUTF8 when the addresses need it. Returns 0,
+// or the reply code the server would give a message it cannot take.
+static int mail_from_command(char *req, size_t size, const char *from, Capabilities *capabilities, MailMessage *message, size_t estimate)
+{
+    int utf8 = !message_is_ascii(from, message);
+
+    if (capability_too_large(capabilities, estimate))
+        return 552;
+
+    if (utf8 && !(capabilities->flags & CAPABILITY_SMTPUTF8))
+        return 553;
+
+    int length = snprintf(req, size, "MAIL FROM: <%s>", from);
+
+    if (capabilities->flags & CAPABILITY_SIZE)
+        length += snprintf(req + length, size - length, " SIZE=%zu", estimate);
+
+    if (capabilities->flags & CAPABILITY_8BITMIME)
+        length += snprintf(req + length, size - length, " BODY=8BITMIME");
+
+    if (utf8)
+        length += snprintf(req + length, size - length, " SMTPUTF8");
+
+    snprintf(req + length, size - length, "\r\n");
+    return 0;
+}
+
+static int rendered_append(SMTPRenderedMessage *rendered, const char *data, size_t length, AttachmentCacheEntry *entry)
+{
+    if (rendered->segmentCount == rendered->segmentCapacity)
+    {
+        int capacity = rendered->segmentCapacity ? rendered->segmentCapacity * 2 : 16;
+        RenderSegment *segments = smtp_realloc(rendered->segments, capacity * sizeof(RenderSegment));
+
+        if (!segments)
+            return -1;
+
+        rendered->segments = segments;
+        rendered->segmentCapacity = capacity;
+    }
+
+    RenderSegment *segment = &rendered->segments[rendered->segmentCount++];
+
+    segment->data = data;
+    segment->length = length;
+    segment->entry = entry;
+    rendered->length += length;
+    return 0;
+}
+
+// Runs the writer from the MIME headers on and keeps what it produces.
+// Encoded attachments are taken whole from the writer, shared with the cache
+// when they came from it, rather than copied.
+SMTPRenderedMessage* smtp_message_render(MailMessage *message)
+{
+    MessageWriter writer;
+    size_t estimate;
+    int length;
+
+    if (message_check_attachments(message, &estimate))
+        return NULL;
+
+    SMTPRenderedMessage *rendered = smtp_calloc(1, sizeof(SMTPRenderedMessage));
+    if (!rendered)
+        return NULL;
+
+    char *piece = smtp_malloc(MESSAGE_WRITER_CHUNK);
+    if (!piece)
+    {
+        free(rendered);
+        return NULL;
+    }
+
+    message_writer_init(&writer, message, NULL, &rendered->arena, "", CAPABILITY_CHUNKING, 0);
+    writer.stage = WRITER_BODY;
+
+    for (;;)
+    {
+        if (writer.stage == WRITER_ATTACHMENT_DATA && writer.cached && writer.offset == 0)
+        {
+            if (rendered_append(rendered, writer.cached->data, writer.cached->length, writer.cached))
+            {
+                length = -1;
+                break;
+            }
+
+            // The segment keeps the writer's reference
+            writer.offset = writer.cached->length;
+            writer.cached = NULL;
+        }
+
+        length = message_writer_next(&writer, piece, MESSAGE_WRITER_CHUNK);
+        if (length <= 0)
+            break;
+
+        char *copy = arena_alloc(&rendered->arena, length);
+
+        if (!copy || rendered_append(rendered, copy, length, NULL))
+        {
+            length = -1;
+            break;
+        }
+
+        memcpy(copy, piece, length);
+    }
+
+    message_writer_close(&writer);
+    free(piece);
+
+    if (length < 0)
+    {
+        smtp_rendered_message_free(rendered);
+        return NULL;
+    }
+
+    return rendered;
+}
+
+void smtp_rendered_message_free(SMTPRenderedMessage *rendered)
+{
+    for (int i = 0; i < rendered->segmentCount; i++) {
+        if (rendered->segments[i].entry)
+            attachment_cache_release(rendered->segments[i].entry);
+    }
+
+    arena_free(&rendered->arena);
+    free(rendered->segments);
+    free(rendered);
+}
+
+// Writes what is buffered, then length bytes of an encoded file with
+// sendfile(), on plain sockets or through kernel TLS
+static int session_send_file(SMTPSession *session, AttachmentCacheEntry *entry, off_t offset, size_t length)
+{
+    size_t buffered = session->outLength;
+
+    session->outLength = 0;
+    if (session_write_all(session, session->out, buffered, 1))
+        return -1;
+
+    while (length > 0)
+    {
+        long ret = session->transport.ops->sendfile(&session->transport, entry->fd, offset, length);
+
+        if (ret <= 0)
+        {
+            session->broken = 1;
+            return -1;
+        }
+
+        offset += ret;
+        length -= ret;
+    }
+
+    session->lastActivity = time(NULL);
+    return 0;
+}
+
+// The writer fills the session's output buffer directly, except for encoded
+// files the transport sends itself
+static int session_write_message(SMTPSession *session, MailMessage *message, SMTPRenderedMessage *rendered)
+{
+    MessageWriter writer;
+    uint64_t started = metrics_now();
+    AttachmentCacheEntry *file;
+    off_t fileOffset;
+    size_t fileLength;
+    int length;
+
+    arena_reset(&session->arena);
+    message_writer_init(&writer, message, rendered, &session->arena, session->client.emailAdress, session->capabilities.flags, session->enableLogs);
+
+    for (;;)
+    {
+        if ((file = message_writer_file(&writer, &session->transport, &fileOffset, &fileLength)))
+        {
+            if (session_send_file(session, file, fileOffset, fileLength))
+            {
+                length = -1;
+                break;
+            }
+
+            message_writer_file_sent(&writer, fileLength);
+            continue;
+        }
+
+        char *dest = session_reserve(session, MESSAGE_WRITER_CHUNK);
+        if (!dest)
+        {
+            length = -1;
+            break;
+        }
+
+        length = message_writer_next(&writer, dest, MESSAGE_WRITER_CHUNK);
+        if (length <= 0)
+            break;
+
+        session->outLength += length;
+    }
+
+    if (length == 0)
+        metrics_record(SMTP_PHASE_UPLOAD, started, writer.produced);
+
+    message_writer_close(&writer);
+    return length;
+}
+
+// Sends the message as BDAT chunks (RFC 3030), each built in place in the
+// empty output buffer right behind its command; an encoded file the transport
+// can send itself goes out whole as a chunk of its own. With PIPELINING the
+// chunks go out back to back and their replies are read once a window of them
+// is outstanding; without it every chunk waits for its reply. Returns the
+// reply to the last chunk, or -1 when the connection had to be dropped.
+static int session_write_chunks(SMTPSession *session, MailMessage *message, SMTPRenderedMessage *rendered)
+{
+    MessageWriter writer;
+    int pipelining = session->capabilities.flags & CAPABILITY_PIPELINING;
+    uint64_t started = metrics_now();
+    uint64_t finished = 0;
+    int pending = 0;
+    int last = 0;
+    int code = 250;
+
+    arena_reset(&session->arena);
+    message_writer_init(&writer, message, rendered, &session->arena, session->client.emailAdress, session->capabilities.flags, session->enableLogs);
+
+    while (!last && code == 250)
+    {
+        AttachmentCacheEntry *file;
+        off_t fileOffset;
+        size_t length;
+
+        if ((file = message_writer_file(&writer, &session->transport, &fileOffset, &length)))
+        {
+            size_t start = bdat_header(session->out, length, 0, session->enableLogs);
+
+            session->outLength = BDAT_HEADER_SIZE - start;
+            memmove(session->out, session->out + start, session->outLength);
+
+            if (session_send_file(session, file, fileOffset, length))
+            {
+                code = -1;
+                break;
+            }
+
+            message_writer_file_sent(&writer, length);
+        }
+        else
+        {
+            if (message_writer_fill(&writer, &session->transport, session->out + BDAT_HEADER_SIZE, BDAT_CHUNK_SIZE, &length, &last))
+            {
+                code = -1;
+                break;
+            }
+
+            size_t start = bdat_header(session->out, length, last, session->enableLogs);
+
+            if (session_write_all(session, session->out + start, BDAT_HEADER_SIZE + length - start, pipelining && !last))
+            {
+                code = -1;
+                break;
+            }
+        }
+
+        pending++;
+
+        if (last)
+        {
+            metrics_record(SMTP_PHASE_UPLOAD, started, writer.produced);
+            finished = metrics_now();
+        }
+
+        // After a refused chunk the rest of the replies are still read
+        while (pending && (!pipelining || last || pending > PIPELINE_WINDOW || code != 250))
+        {
+            int reply = session_read_reply(session);
+
+            pending--;
+
+            if (reply < 0)
+            {
+                code = -1;
+                break;
+            }
+
+            if (code == 250)
+                code = reply;
+        }
+    }
+
+    if (code == 250)
+        metrics_record(SMTP_PHASE_FINAL_REPLY, finished, 0);
+
+    message_writer_close(&writer);
+
+    // Part of a chunk may be missing, so the session cannot continue
+    if (code < 0)
+        session_disconnect(session);
+
+    return code;
+}
+
+// Envelope commands waiting for their replies. With PIPELINING up to a full
+// window is written at once; without it the window holds a single command.
+typedef struct Pipeline Pipeline;
+struct Pipeline
+{
+    char buffer[4096];
+    size_t length;
+    int count;
+    int kinds[PIPELINE_WINDOW];
+    Recipient *recipients[PIPELINE_WINDOW];
+    int rejected;       // RSET or MAIL FROM failed
+    int accepted;       // recipients the server took
+    int dataCode;
+};
+
+enum { COMMAND_RSET, COMMAND_MAIL, COMMAND_RCPT, COMMAND_DATA };
+
+// Writes the queued commands and matches every reply to its command. All
+// replies are consumed, even after a failure, to keep the session in sync.
+static int pipeline_flush(SMTPSession *session, Pipeline *pipeline)
+{
+    if (!pipeline->count)
+        return 0;
+
+    if (session->enableLogs)
+        log_protocol(SMTP_LOG_CLIENT, pipeline->buffer, pipeline->length, 0);
+
+    if (session_write(session, pipeline->buffer, pipeline->length))
+        return -1;
+
+    for (int i = 0; i < pipeline->count; i++)
+    {
+        int code = session_read_reply(session);
+        if (code < 0)
+            return -1;
+
+        switch (pipeline->kinds[i])
+        {
+            case COMMAND_RSET:
+            case COMMAND_MAIL:
+                if (code != 250)
+                {
+                    if (!pipeline->rejected)
+                        session->failureCode = code;
+
+                    pipeline->rejected = 1;
+                }
+                break;
+
+            case COMMAND_RCPT:
+                pipeline->recipients[i]->status = code;
+                if (code == 250 || code == 251)
+                    pipeline->accepted++;
+                break;
+
+            case COMMAND_DATA:
+                pipeline->dataCode = code;
+                if (code != 354 && !session->failureCode)
+                    session->failureCode = code;
+                break;
+        }
+    }
+
+    pipeline->length = 0;
+    pipeline->count = 0;
+    return 0;
+}
+
+static int pipeline_queue(SMTPSession *session, Pipeline *pipeline, int kind, Recipient *recipient, const char *req)
+{
+    size_t length = strlen(req);
+
+    if (pipeline->count == PIPELINE_WINDOW || pipeline->length + length > sizeof(pipeline->buffer))
+    {
+        if (pipeline_flush(session, pipeline))
+            return -1;
+    }
+
+    memcpy(pipeline->buffer + pipeline->length, req, length);
+    pipeline->length += length;
+    pipeline->kinds[pipeline->count] = kind;
+    pipeline->recipients[pipeline->count] = recipient;
+    pipeline->count++;
+
+    if (!(session->capabilities.flags & CAPABILITY_PIPELINING))
+        return pipeline_flush(session, pipeline);
+
+    return 0;
+}
+
+// Sends the envelope (RSET, MAIL FROM, one RCPT TO per recipient, DATA) and
+// returns 0 once DATA got 354, or with CHUNKING once a recipient was taken.
+// Recipient status fields receive the RCPT TO reply codes.
+static int session_envelope(SMTPSession *session, MailMessage *message, size_t estimate)
+{
+    Pipeline pipeline = {0};
+    char req[1100];
+    int pipelining = session->capabilities.flags & CAPABILITY_PIPELINING;
+    int chunking = session->capabilities.flags & CAPABILITY_CHUNKING;
+
+    // The server may announce a different limit after reconnecting
+    int refused = mail_from_command(req, sizeof(req), session->client.emailAdress, &session->capabilities, message, estimate);
+    if (refused)
+    {
+        session->failureCode = refused;
+        return -1;
+    }
+
+    if (session->transactions++ > 0 && pipeline_queue(session, &pipeline, COMMAND_RSET, NULL, "RSET\r\n"))
+        return -1;
+
+    if (pipeline_queue(session, &pipeline, COMMAND_MAIL, NULL, req))
+        return -1;
+
+    if (pipeline.rejected)
+        return -1;
+
+    for (RecipientListNode* current = message->recipientList.head; current; current = current->next)
+    {
+        snprintf(req, sizeof(req), "RCPT TO: <%s>\r\n", current->recipient.emailAdress.data);
+        if (pipeline_queue(session, &pipeline, COMMAND_RCPT, &current->recipient, req))
+            return -1;
+    }
+
+    // Without pipelining every reply is known by now, so DATA is only sent
+    // when the server took at least one recipient
+    if (!pipelining && (pipeline.rejected || !pipeline.accepted))
+        return -1;
+
+    // With CHUNKING the content follows as BDAT once the envelope is taken
+    if (chunking)
+    {
+        if (pipeline_flush(session, &pipeline))
+            return -1;
+
+        return pipeline.rejected || !pipeline.accepted ? -1 : 0;
+    }
+
+    if (pipeline_queue(session, &pipeline, COMMAND_DATA, NULL, "DATA\r\n") || pipeline_flush(session, &pipeline))
+        return -1;
+
+    if (pipeline.dataCode == 354 && (pipeline.rejected || !pipeline.accepted))
+    {
+        // The server opened DATA for an envelope it refused; close it empty
+        session_command(session, ".\r\n");
+        return -1;
+    }
+
+    return pipeline.dataCode == 354 ? 0 : -1;
+}
+
+// Runs one MAIL FROM .. "." transaction. *committed is set once the server
+// has accepted DATA, after which the message must not be replayed.
+static int session_transaction(SMTPSession *session, MailMessage *message, SMTPRenderedMessage *rendered, size_t estimate, int *committed)
+{
+    session->failureCode = 0;
+
+    for (RecipientListNode* current = message->recipientList.head; current; current = current->next)
+        current->recipient.status = 0;
+
+    uint64_t started = metrics_now();
+
+    if (session_envelope(session, message, estimate))
+        return -1;
+
+    metrics_record(SMTP_PHASE_ENVELOPE, started, 0);
+    *committed = 1;
+
+    int code;
+
+    if (session->capabilities.flags & CAPABILITY_CHUNKING)
+        code = session_write_chunks(session, message, rendered);
+    else if (session_write_message(session, message, rendered))
+    {
+        // The server is still waiting for the end of the DATA block
+        session_disconnect(session);
+        return -1;
+    }
+    else
+    {
+        started = metrics_now();
+        code = session_command(session, ".\r\n");
+
+        if (code == 250)
+            metrics_record(SMTP_PHASE_FINAL_REPLY, started, 0);
+    }
+
+    if (code != 250)
+    {
+        session->failureCode = code > 0 ? code : 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+SMTPSession* smtp_session_open(SMTPClient client, int enableLogs)
+{
+    if (client.port != 465 && client.port != 587 && client.port != 2525)
+        return NULL;
+
+    ignore_sigpipe();
+
+    SMTPSession *session = smtp_calloc(1, sizeof(SMTPSession));
+    if (!session)
+        return NULL;
+
+    session->client = client;
+    session->enableLogs = enableLogs;
+    session->transport.fd = -1;
+
+    if (session_connect(session))
+    {
+        smtp_session_close(session);
+        return NULL;
+    }
+
+    return session;
+}
+
+SMTPSession* smtp_session_open_transport(SMTPClient client, SMTPTransport transport, int enableLogs)
+{
+    if (!transport.read || !transport.write)
+        return NULL;
+
+    SMTPSession *session = smtp_calloc(1, sizeof(SMTPSession));
+    if (!session)
+    {
+        if (transport.close)
+            transport.close(transport.context);
+
+        return NULL;
+    }
+
+    session->client = client;
+    session->enableLogs = enableLogs;
+    session->customTransport = 1;
+    session->transport.fd = -1;
+    session->transport.custom = transport;
+    session->transport.ops = &customTransport;
+
+    if (session_greet(session))
+    {
+        smtp_session_close(session);
+        return NULL;
+    }
+
+    return session;
+}
+
+// A session idle this long is probed with NOOP before it is used again, and
+// one idle past the usual five-minute server timeout is reconnected outright
+#define SESSION_PROBE_SECONDS 30
+#define SESSION_EXPIRE_SECONDS 300
+
+// Drops an idle connection the server no longer answers on, so the message
+// goes out over a fresh one. A custom transport cannot be reopened, so it is
+// only probed.
+static void session_check_idle(SMTPSession *session)
+{
+    if (!session->transport.ops)
+        return;
+
+    time_t idle = time(NULL) - session->lastActivity;
+
+    if (idle < SESSION_PROBE_SECONDS)
+        return;
+
+    if ((idle >= SESSION_EXPIRE_SECONDS && !session->customTransport) || session_command(session, "NOOP\r\n") != 250)
+        session_disconnect(session);
+}
+
+static int session_send(SMTPSession *session, MailMessage *message, SMTPRenderedMessage *rendered, size_t estimate)
+{
+    Capabilities known;
+
+    session_check_idle(session);
+
+    // A message the server already said it cannot take is refused without
+    // reconnecting for it
+    if (!session->transport.ops && !capability_cache_find(&session->client, &known)
+        && capability_too_large(&known, estimate))
+    {
+        session->failureCode = 552;
+        return -1;
+    }
+
+    // A connection the server dropped while idle is re-established once,
+    // as long as the message content has not been handed over yet
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        int committed = 0;
+
+        if (!session->transport.ops && session_connect(session))
+            return -1;
+
+        if (session_transaction(session, message, rendered, estimate, &committed) == 0)
+            return 0;
+
+        if (committed || (!session->broken && session->transport.ops))
+            return -1;
+
+        session_disconnect(session);
+    }
+
+    return -1;
+}
+
+int smtp_session_send(SMTPSession *session, MailMessage *message)
+{
+    size_t estimate;
+
+    session->failureCode = 0;
+
+    if (!message->recipientList.numberOfElements)
+        return -1;
+
+    if (message_check_attachments(message, &estimate))
+        return -1;
+
+    return session_send(session, message, NULL, estimate);
+}
+
+int smtp_session_send_rendered(SMTPSession *session, SMTPRenderedMessage *rendered, MailMessage *envelope)
+{
+    // The headers written in front of the rendered part
+    size_t estimate = rendered->length + 512;
+
+    session->failureCode = 0;
+
+    if (!envelope->recipientList.numberOfElements)
+        return -1;
+
+    for (RecipientListNode* node = envelope->recipientList.head; node; node = node->next)
+        estimate += node->recipient.emailAdress.length + 4;
+
+    return session_send(session, envelope, rendered, estimate);
+}
+
+void smtp_session_get_last_reply(SMTPSession *session, SMTPReply *reply)
+{
+    *reply = session->lastReply;
+}
+
+int smtp_session_noop(SMTPSession *session)
+{
+    if (session->transport.ops && session_command(session, "NOOP\r\n") == 250)
+        return 0;
+
+    session_disconnect(session);
+    return session_connect(session);
+}
+
+void smtp_session_close(SMTPSession *session)
+{
+    if (!session)
+        return;
+
+    if (session->transport.ops && !session->broken)
+        session_command(session, "QUIT\r\n");
+
+    session_disconnect(session);
+    arena_free(&session->arena);
+    free(session);
+}
+
+void send_email(SMTPClient client, MailMessage *message, int enableLogs)
+{
+    if (client.port == 25)
+    {
+        perror("Port 25 is no longer used");
+        exit(1);
+    }
+    else if (client.port != 465 && client.port != 587 && client.port != 2525)
+    {
+        perror("Unknown smtp port\n");
+        exit(1);
+    }
+
+    SMTPSession *session = smtp_session_open(client, enableLogs);
+    if (!session)
+        return;
+
+    smtp_session_send(session, message);
+    smtp_session_close(session);
+}
+
+typedef struct PoolServer PoolServer;
+struct PoolServer
+{
+    char mailServer[1024];
+    char emailAdress[1024];
+    int port;
+    int openConnections;
+    SMTPSession *idle;          // idle sessions, linked through poolNext
+    pthread_cond_t available;
+    PoolServer *next;
+};
+
+struct SMTPPool
+{
+    pthread_mutex_t lock;
+    int maxConnectionsPerServer;
+    int enableLogs;
+    PoolServer *servers;
+    SMTPPoolStats stats;
+};
+
+static double monotonic_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Called with pool->lock held
+static PoolServer* pool_find_server(SMTPPool *pool, SMTPClient *client, int create)
+{
+    PoolServer *server;
+
+    for (server = pool->servers; server; server = server->next)
+    {
+        if (server->port == client->port
+            && strcmp(server->mailServer, client->mailServer) == 0
+            && strcmp(server->emailAdress, client->emailAdress) == 0)
+            return server;
+    }
+
+    if (!create)
+        return NULL;
+
+    server = smtp_calloc(1, sizeof(PoolServer));
+    if (!server)
+        return NULL;
+
+    strcpy(server->mailServer, client->mailServer);
+    strcpy(server->emailAdress, client->emailAdress);
+    server->port = client->port;
+    pthread_cond_init(&server->available, NULL);
+
+    server->next = pool->servers;
+    pool->servers = server;
+
+    return server;
+}
+
+SMTPPool* smtp_pool_create(int maxConnectionsPerServer, int enableLogs)
+{
+    if (maxConnectionsPerServer < 1)
+        return NULL;
+
+    SMTPPool *pool = smtp_calloc(1, sizeof(SMTPPool));
+    if (!pool)
+        return NULL;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->maxConnectionsPerServer = maxConnectionsPerServer;
+    pool->enableLogs = enableLogs;
+
+    return pool;
+}
+
+SMTPSession* smtp_pool_acquire(SMTPPool *pool, SMTPClient client)
+{
+    SMTPSession *session = NULL;
+    double start = monotonic_seconds();
+    int waited = 0;
+
+    pthread_mutex_lock(&pool->lock);
+
+    PoolServer *server = pool_find_server(pool, &client, 1);
+    if (!server)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+
+    pool->stats.acquisitions++;
+
+    while (!server->idle && server->openConnections >= pool->maxConnectionsPerServer)
+    {
+        waited = 1;
+        pthread_cond_wait(&server->available, &pool->lock);
+    }
+
+    if (waited)
+    {
+        double wait = monotonic_seconds() - start;
+
+        pool->stats.waits++;
+        pool->stats.totalWaitSeconds += wait;
+        if (wait > pool->stats.maxWaitSeconds)
+            pool->stats.maxWaitSeconds = wait;
+    }
+
+    if (server->idle)
+    {
+        session = server->idle;
+        server->idle = session->poolNext;
+        session->poolNext = NULL;
+        pool->stats.hits++;
+        pool->stats.idleConnections--;
+
+        pthread_mutex_unlock(&pool->lock);
+        return session;
+    }
+
+    // Reserve the slot before connecting so the limit holds while unlocked
+    server->openConnections++;
+    pool->stats.misses++;
+    pool->stats.openConnections++;
+    pthread_mutex_unlock(&pool->lock);
+
+    session = smtp_session_open(client, pool->enableLogs);
+    if (session)
+        return session;
+
+    pthread_mutex_lock(&pool->lock);
+    server->openConnections--;
+    pool->stats.failures++;
+    pool->stats.openConnections--;
+    pthread_cond_signal(&server->available);
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+void smtp_pool_release(SMTPPool *pool, SMTPSession *session)
+{
+    if (!session)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+
+    PoolServer *server = pool_find_server(pool, &session->client, 0);
+    if (!server)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        smtp_session_close(session);
+        return;
+    }
+
+    // A session that lost its connection and could not get it back is dropped
+    if (!session->transport.ops)
+    {
+        server->openConnections--;
+        pool->stats.openConnections--;
+        pthread_cond_signal(&server->available);
+        pthread_mutex_unlock(&pool->lock);
+
+        smtp_session_close(session);
+        return;
+    }
+
+    session->poolNext = server->idle;
+    server->idle = session;
+    pool->stats.idleConnections++;
+
+    pthread_cond_signal(&server->available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int smtp_pool_send(SMTPPool *pool, SMTPClient client, MailMessage *message)
+{
+    SMTPSession *session = smtp_pool_acquire(pool, client);
+    if (!session)
+        return -1;
+
+    int ret = smtp_session_send(session, message);
+    smtp_pool_release(pool, session);
+
+    return ret;
+}
+
+void smtp_pool_get_stats(SMTPPool *pool, SMTPPoolStats *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Closes every idle session. All acquired sessions must have been released.
+void smtp_pool_destroy(SMTPPool *pool)
+{
+    if (!pool)
+        return;
+
+    while (pool->servers)
+    {
+        PoolServer *server = pool->servers;
+
+        while (server->idle)
+        {
+            SMTPSession *session = server->idle;
+
+            server->idle = session->poolNext;
+            smtp_session_close(session);
+        }
+
+        pool->servers = server->next;
+        pthread_cond_destroy(&server->available);
+        free(server);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+typedef enum AsyncState
+{
+    ASYNC_CONNECTING,
+    ASYNC_HANDSHAKE,
+    ASYNC_GREETING,
+    ASYNC_EHLO,
+    ASYNC_STARTTLS,
+    ASYNC_AUTH,
+    ASYNC_ENVELOPE,
+    ASYNC_CONTENT,
+    ASYNC_DATA_END,
+    ASYNC_QUIT,
+    ASYNC_DONE
+} AsyncState;
+
+typedef struct AsyncCommand AsyncCommand;
+struct AsyncCommand
+{
+    int kind;
+    Recipient *recipient;
+};
+
+// One message in flight on its own non-blocking connection
+typedef struct AsyncConnection AsyncConnection;
+struct AsyncConnection
+{
+    SMTPEngine *engine;
+    SMTPClient client;
+    MailMessage *message;
+    SMTPCompletionCallback callback;
+    void *userData;
+    size_t estimate;
+
+    Transport transport;
+    UringIO io;             // the socket's operations on io_uring
+    int closing;            // completed, waiting for its operations to end
+    int ready;
+    AsyncConnection *readyNext;
+    struct addrinfo *addresses;
+    struct addrinfo *address;
+    AsyncState state;
+    uint64_t stateSince;    // for metrics, 0 while they are off
+    Capabilities capabilities;
+    int authStep;
+    int events;
+    int wantWrite;
+    time_t lastActivity;
+
+    SMTPArena arena;        // per-message allocations, reset on reuse
+    AsyncCommand *commands;
+    int commandCount;
+    int commandsSent;
+    int repliesSeen;
+    int rejected;
+    int accepted;
+    int chunked;            // content goes out as BDAT
+    int chunksSent;
+    int chunkReplies;
+    MessageWriter writer;
+
+    char *out;
+    size_t outOffset;
+    size_t outLength;
+    size_t outCapacity;
+    ReplyParser parser;
+    char in[4096];
+    size_t inLength;
+
+    AsyncConnection *prev;
+    AsyncConnection *next;
+};
+
+struct SMTPEngine
+{
+    SMTPEngineBackend backend;
+    int epollfd;
+    Uring ring;
+    AsyncConnection *ready;     // to drive without waiting for the kernel
+    int closing;
+    int enableLogs;
+    int timeoutSeconds;
+    int inFlight;
+    time_t lastSweep;
+    AsyncConnection *connections;
+    AsyncConnection *spare;     // finished connections kept for reuse
+};
+
+// The phase each state's time is counted in, -1 for none
+static const int asyncPhases[] = {
+    [ASYNC_CONNECTING] = SMTP_PHASE_CONNECT,
+    [ASYNC_HANDSHAKE] = SMTP_PHASE_TLS,
+    [ASYNC_GREETING] = SMTP_PHASE_GREETING,
+    [ASYNC_EHLO] = SMTP_PHASE_EHLO,
+    [ASYNC_STARTTLS] = -1,
+    [ASYNC_AUTH] = SMTP_PHASE_AUTH,
+    [ASYNC_ENVELOPE] = SMTP_PHASE_ENVELOPE,
+    [ASYNC_CONTENT] = SMTP_PHASE_UPLOAD,
+    [ASYNC_DATA_END] = SMTP_PHASE_FINAL_REPLY,
+    [ASYNC_QUIT] = -1,
+    [ASYNC_DONE] = -1
+};
+
+// Moves to the next state, counting the time spent in the one left
+static void async_enter(AsyncConnection *conn, AsyncState state)
+{
+    int phase = asyncPhases[conn->state];
+
+    if (conn->stateSince && phase >= 0)
+        metrics_record(phase, conn->stateSince, conn->state == ASYNC_CONTENT ? conn->writer.produced : 0);
+
+    conn->state = state;
+    conn->stateSince = metrics_now();
+}
+
+// Connections are recycled together with their output buffer and arena, so
+// a warmed-up engine allocates nothing per message
+static AsyncConnection* async_acquire(SMTPEngine *engine)
+{
+    AsyncConnection *conn = engine->spare;
+
+    if (!conn)
+        return smtp_calloc(1, sizeof(AsyncConnection));
+
+    engine->spare = conn->next;
+
+    char *out = conn->out;
+    size_t outCapacity = conn->outCapacity;
+    SMTPArena arena = conn->arena;
+    char *sendBuffer = conn->io.sendBuffer;
+    char *recvBuffer = conn->io.recvBuffer;
+
+    memset(conn, 0, sizeof(AsyncConnection));
+    conn->out = out;
+    conn->outCapacity = outCapacity;
+    conn->arena = arena;
+    conn->io.sendBuffer = sendBuffer;
+    conn->io.recvBuffer = recvBuffer;
+    return conn;
+}
+
+// On io_uring the kernel may still write into the connection's buffers, so
+// it is only reused once the last of its operations completed
+static void async_release(SMTPEngine *engine, AsyncConnection *conn)
+{
+    if (conn->io.pending)
+    {
+        if (!conn->closing)
+            engine->closing++;
+
+        conn->closing = 1;
+        return;
+    }
+
+    if (conn->closing)
+        engine->closing--;
+
+    conn->closing = 0;
+    arena_reset(&conn->arena);
+    conn->next = engine->spare;
+    engine->spare = conn;
+}
+
+static void async_complete(AsyncConnection *conn, int result)
+{
+    SMTPEngine *engine = conn->engine;
+
+    if (engine->backend == SMTP_ENGINE_EPOLL && conn->transport.fd >= 0)
+        epoll_ctl(engine->epollfd, EPOLL_CTL_DEL, conn->transport.fd, NULL);
+
+    // Only timeouts and smtp_engine_destroy() find it still waiting
+    if (conn->ready)
+    {
+        AsyncConnection **link = &engine->ready;
+
+        while (*link != conn)
+            link = &(*link)->readyNext;
+
+        *link = conn->readyNext;
+        conn->ready = 0;
+    }
+
+    // A close_notify that does not fit the socket buffer is just dropped
+    transport_close(&conn->transport, result == 0);
+
+    if (conn->addresses)
+        freeaddrinfo(conn->addresses);
+
+    message_writer_close(&conn->writer);
+
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        engine->connections = conn->next;
+
+    if (conn->next)
+        conn->next->prev = conn->prev;
+
+    engine->inFlight--;
+
+    if (conn->callback)
+        conn->callback(conn->message, result, conn->userData);
+
+    async_release(engine, conn);
+}
+
+// Makes room for at least length more bytes at the end of the output buffer
+static int async_reserve(AsyncConnection *conn, size_t length)
+{
+    if (conn->outOffset == conn->outLength)
+        conn->outOffset = conn->outLength = 0;
+
+    if (conn->outLength + length <= conn->outCapacity)
+        return 0;
+
+    // Unsent bytes only ever move towards the front, which OpenSSL allows
+    // with SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+    if (conn->outOffset)
+    {
+        memmove(conn->out, conn->out + conn->outOffset, conn->outLength - conn->outOffset);
+        conn->outLength -= conn->outOffset;
+        conn->outOffset = 0;
+    }
+
+    if (conn->outLength + length <= conn->outCapacity)
+        return 0;
+
+    size_t capacity = conn->outCapacity ? conn->outCapacity : 4096;
+    while (capacity < conn->outLength + length)
+        capacity *= 2;
+
+    char *out = smtp_realloc(conn->out, capacity);
+    if (!out)
+        return -1;
+
+    conn->out = out;
+    conn->outCapacity = capacity;
+    return 0;
+}
+
+static int async_queue_line(AsyncConnection *conn, const char *req, int secret)
+{
+    size_t length = strlen(req);
+
+    if (conn->engine->enableLogs)
+        log_protocol(SMTP_LOG_CLIENT, req, length, secret);
+
+    if (async_reserve(conn, length))
+        return -1;
+
+    memcpy(conn->out + conn->outLength, req, length);
+    conn->outLength += length;
+    return 0;
+}
+
+static int async_queue(AsyncConnection *conn, const char *req)
+{
+    return async_queue_line(conn, req, 0);
+}
+
+// Writes queued output until the socket would block. Returns the number of
+// bytes written or -1 when the connection failed.
+static long async_flush(AsyncConnection *conn)
+{
+    long written = 0;
+
+    conn->wantWrite = 0;
+
+    while (conn->outOffset < conn->outLength)
+    {
+        size_t length = conn->outLength - conn->outOffset;
+        int more = conn->state == ASYNC_CONTENT && !conn->chunked;
+
+        // While content is still being produced only full records go out;
+        // the tail waits for the next block
+        if (more && length >= TLS_RECORD_SIZE)
+            length -= length % TLS_RECORD_SIZE;
+        else if (more)
+            break;
+
+        long ret = conn->transport.ops->write(&conn->transport, conn->out + conn->outOffset, length, more);
+
+        if (ret < 0)
+            return -1;
+
+        if (ret == 0)
+        {
+            conn->wantWrite = conn->transport.wantWrite;
+            return written;
+        }
+
+        conn->outOffset += ret;
+        written += ret;
+    }
+
+    if (written)
+        conn->lastActivity = time(NULL);
+
+    return written;
+}
+
+// Reads until the socket would block. Returns 0, or -1 once the server
+// closed the connection or it failed.
+static int async_fill(AsyncConnection *conn)
+{
+    while (conn->inLength < sizeof(conn->in))
+    {
+        long ret = conn->transport.ops->read(&conn->transport, conn->in + conn->inLength, sizeof(conn->in) - conn->inLength);
+
+        if (ret < 0)
+            return -1;
+
+        if (ret == 0)
+        {
+            if (conn->transport.wantWrite)
+                conn->wantWrite = 1;
+
+            return 0;
+        }
+
+        conn->inLength += ret;
+        conn->lastActivity = time(NULL);
+    }
+
+    return 0;
+}
+
+static int async_start_tls(AsyncConnection *conn)
+{
+    if (transport_start_tls(&conn->transport, &conn->client))
+        return -1;
+
+    SSL_set_mode(conn->transport.ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_set_connect_state(conn->transport.ssl);
+
+    // Records go through the connection's io_uring buffers instead of the socket
+    if (conn->engine->backend == SMTP_ENGINE_IO_URING)
+    {
+        pthread_once(&uringBioOnce, uring_bio_init);
+
+        BIO *bio = uringBioMethod ? BIO_new(uringBioMethod) : NULL;
+        if (!bio)
+            return -1;
+
+        BIO_set_data(bio, &conn->transport);
+        SSL_set_bio(conn->transport.ssl, bio, bio);
+        conn->transport.ops = &uringTlsTransport;
+    }
+
+    async_enter(conn, ASYNC_HANDSHAKE);
+    return 0;
+}
+
+// Returns 1 once the handshake finished, 0 while it waits for the socket
+static int async_handshake(AsyncConnection *conn)
+{
+    ERR_clear_error();
+    int ret = SSL_do_handshake(conn->transport.ssl);
+
+    if (ret != 1)
+    {
+        int error = SSL_get_error(conn->transport.ssl, ret);
+
+        if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+        {
+            conn->wantWrite = error == SSL_ERROR_WANT_WRITE;
+            return 0;
+        }
+
+        return -1;
+    }
+
+    tls_handshake_done(conn->transport.ssl);
+    conn->lastActivity = time(NULL);
+
+    // Implicit TLS still waits for the greeting, STARTTLS says EHLO again
+    if (conn->client.port == 465)
+    {
+        async_enter(conn, ASYNC_GREETING);
+        return 1;
+    }
+
+    async_enter(conn, ASYNC_EHLO);
+    memset(&conn->capabilities, 0, sizeof(Capabilities));
+    return async_queue(conn, "EHLO localhost\r\n") ? -1 : 1;
+}
+
+static int async_send_command(AsyncConnection *conn)
+{
+    AsyncCommand *command = &conn->commands[conn->commandsSent++];
+    char req[1100];
+
+    switch (command->kind)
+    {
+        case COMMAND_MAIL:
+            mail_from_command(req, sizeof(req), conn->client.emailAdress, &conn->capabilities, conn->message, conn->estimate);
+            break;
+
+        case COMMAND_RCPT:
+            snprintf(req, sizeof(req), "RCPT TO: <%s>\r\n", command->recipient->emailAdress.data);
+            break;
+
+        default:
+            strcpy(req, "DATA\r\n");
+            break;
+    }
+
+    return async_queue(conn, req);
+}
+
+static int async_finish(AsyncConnection *conn, int result)
+{
+    async_enter(conn, ASYNC_QUIT);
+    conn->rejected = result != 0;
+    return async_queue(conn, "QUIT\r\n");
+}
+
+static int async_start_envelope(AsyncConnection *conn)
+{
+    int count = 2 + conn->message->recipientList.numberOfElements;
+    char req[1100];
+    int i = 0;
+
+    if (mail_from_command(req, sizeof(req), conn->client.emailAdress, &conn->capabilities, conn->message, conn->estimate))
+        return async_finish(conn, -1);
+
+    conn->commands = arena_alloc(&conn->arena, count * sizeof(AsyncCommand));
+    if (!conn->commands)
+        return -1;
+
+    memset(conn->commands, 0, count * sizeof(AsyncCommand));
+
+    conn->commands[i++].kind = COMMAND_MAIL;
+
+    for (RecipientListNode* current = conn->message->recipientList.head; current; current = current->next)
+    {
+        current->recipient.status = 0;
+        conn->commands[i].kind = COMMAND_RCPT;
+        conn->commands[i++].recipient = &current->recipient;
+    }
+
+    // With CHUNKING the content follows as BDAT instead of DATA
+    conn->chunked = (conn->capabilities.flags & CAPABILITY_CHUNKING) != 0;
+    if (!conn->chunked)
+        conn->commands[i++].kind = COMMAND_DATA;
+
+    conn->commandCount = i;
+    async_enter(conn, ASYNC_ENVELOPE);
+
+    // Nothing in flight can deadlock here, replies are read as they arrive
+    do
+    {
+        if (async_send_command(conn))
+            return -1;
+    }
+    while ((conn->capabilities.flags & CAPABILITY_PIPELINING) && conn->commandsSent < conn->commandCount);
+
+    return 0;
+}
+
+static int async_envelope_reply(AsyncConnection *conn, int code)
+{
+    AsyncCommand *command = &conn->commands[conn->repliesSeen++];
+
+    switch (command->kind)
+    {
+        case COMMAND_MAIL:
+            if (code != 250)
+                conn->rejected = 1;
+            break;
+
+        case COMMAND_RCPT:
+            command->recipient->status = code;
+            if (code == 250 || code == 251)
+                conn->accepted++;
+            break;
+
+        case COMMAND_DATA:
+            if (code != 354)
+                return async_finish(conn, -1);
+
+            if (conn->rejected || !conn->accepted)
+            {
+                // The server opened DATA for an envelope it refused; close it empty
+                async_enter(conn, ASYNC_DATA_END);
+                return async_queue(conn, ".\r\n");
+            }
+
+            async_enter(conn, ASYNC_CONTENT);
+            message_writer_init(&conn->writer, conn->message, NULL, &conn->arena, conn->client.emailAdress, conn->capabilities.flags, conn->engine->enableLogs);
+            return 0;
+    }
+
+    if (conn->chunked && conn->repliesSeen == conn->commandCount)
+    {
+        if (conn->rejected || !conn->accepted)
+            return async_finish(conn, -1);
+
+        async_enter(conn, ASYNC_CONTENT);
+        message_writer_init(&conn->writer, conn->message, NULL, &conn->arena, conn->client.emailAdress, conn->capabilities.flags, conn->engine->enableLogs);
+        return 0;
+    }
+
+    if (conn->capabilities.flags & CAPABILITY_PIPELINING)
+        return 0;
+
+    // Without pipelining the next command waits for this reply
+    if (conn->rejected)
+        return async_finish(conn, -1);
+
+    if (conn->commands[conn->commandsSent].kind == COMMAND_DATA && !conn->accepted)
+        return async_finish(conn, -1);
+
+    return async_send_command(conn);
+}
+
+// Advances the dialog by one server reply
+static int async_reply(AsyncConnection *conn, int code)
+{
+    char req[4096];
+
+    switch (conn->state)
+    {
+        case ASYNC_GREETING:
+            if (code != 220)
+                return -1;
+
+            async_enter(conn, ASYNC_EHLO);
+            memset(&conn->capabilities, 0, sizeof(Capabilities));
+            return async_queue(conn, "EHLO localhost\r\n");
+
+        case ASYNC_EHLO:
+            if (code != 250)
+                return -1;
+
+            capability_cache_store(&conn->client, &conn->capabilities);
+
+            if (conn->client.port != 465 && conn->client.enableSSL && !conn->transport.ssl)
+            {
+                async_enter(conn, ASYNC_STARTTLS);
+                return async_queue(conn, "STARTTLS\r\n");
+            }
+
+            async_enter(conn, ASYNC_AUTH);
+            conn->authStep = 0;
+
+            if (conn->client.authType == LOGIN)
+                return async_queue(conn, "AUTH LOGIN\r\n");
+
+            auth_xoauth2_command(req, &conn->client);
+            return async_queue(conn, req);
+
+        case ASYNC_STARTTLS:
+            // Anything already buffered was sent in plaintext before the handshake
+            if (code != 220 || conn->inLength)
+                return -1;
+
+            return async_start_tls(conn);
+
+        case ASYNC_AUTH:
+            if (conn->client.authType == LOGIN && conn->authStep < 2)
+            {
+                if (code != 334)
+                    return -1;
+
+                auth_login_line(req, conn->authStep++ ? conn->client.secretCode : conn->client.emailAdress);
+                return async_queue_line(conn, req, 1);
+            }
+
+            if (code != 235)
+                return -1;
+
+            return async_start_envelope(conn);
+
+        case ASYNC_ENVELOPE:
+            return async_envelope_reply(conn, code);
+
+        case ASYNC_CONTENT:
+            // Only BDAT chunks are answered while content is produced
+            if (!conn->chunked)
+                return -1;
+
+            conn->chunkReplies++;
+            return code == 250 ? 0 : async_finish(conn, -1);
+
+        case ASYNC_DATA_END:
+            if (conn->chunked && ++conn->chunkReplies < conn->chunksSent && code == 250)
+                return 0;
+
+            return async_finish(conn, code == 250 && !conn->rejected && conn->accepted ? 0 : -1);
+
+        case ASYNC_QUIT:
+            async_enter(conn, ASYNC_DONE);
+            return 0;
+
+        default:
+            // Nothing else expects a reply; a server giving up mid-DATA lands here
+            return -1;
+    }
+}
+
+// Whether the next BDAT chunk can be built: the last one is fully written
+// and, without PIPELINING, acknowledged
+static int async_chunk_ready(AsyncConnection *conn)
+{
+    if (conn->outOffset < conn->outLength)
+        return 0;
+
+    return (conn->capabilities.flags & CAPABILITY_PIPELINING) ? conn->chunksSent - conn->chunkReplies <= PIPELINE_WINDOW
+                                                                 : conn->chunkReplies == conn->chunksSent;
+}
+
+// Builds one BDAT chunk in the empty output buffer, right behind its command
+static int async_produce_chunk(AsyncConnection *conn)
+{
+    size_t length;
+    int last;
+
+    if (!async_chunk_ready(conn))
+        return 0;
+
+    if (async_reserve(conn, BDAT_HEADER_SIZE + BDAT_CHUNK_SIZE))
+        return -1;
+
+    if (message_writer_fill(&conn->writer, NULL, conn->out + BDAT_HEADER_SIZE, BDAT_CHUNK_SIZE, &length, &last))
+        return -1;
+
+    conn->outOffset = bdat_header(conn->out, length, last, conn->engine->enableLogs);
+    conn->outLength = BDAT_HEADER_SIZE + length;
+    conn->chunksSent++;
+
+    if (last)
+    {
+        message_writer_close(&conn->writer);
+        async_enter(conn, ASYNC_DATA_END);
+    }
+
+    return 0;
+}
+
+// Produces the next piece of the message once most of the output is sent
+static int async_produce(AsyncConnection *conn)
+{
+    if (conn->chunked)
+        return async_produce_chunk(conn);
+
+    if (conn->outLength - conn->outOffset >= MESSAGE_WRITER_CHUNK)
+        return 0;
+
+    if (async_reserve(conn, MESSAGE_WRITER_CHUNK))
+        return -1;
+
+    int length = message_writer_next(&conn->writer, conn->out + conn->outLength, MESSAGE_WRITER_CHUNK);
+    if (length < 0)
+        return -1;
+
+    if (length == 0)
+    {
+        message_writer_close(&conn->writer);
+        async_enter(conn, ASYNC_DATA_END);
+        return async_queue(conn, ".\r\n");
+    }
+
+    conn->outLength += length;
+    return 0;
+}
+
+static void async_fail(AsyncConnection *conn)
+{
+    async_complete(conn, -1);
+}
+
+// Whether the connection has output to produce or send, which is what
+// EPOLLOUT waits for
+static int async_wants_write(AsyncConnection *conn)
+{
+    return conn->wantWrite || conn->outOffset < conn->outLength
+        || (conn->state == ASYNC_CONTENT && (!conn->chunked || async_chunk_ready(conn)));
+}
+
+static void async_make_ready(AsyncConnection *conn)
+{
+    if (conn->ready)
+        return;
+
+    conn->ready = 1;
+    conn->readyNext = conn->engine->ready;
+    conn->engine->ready = conn;
+}
+
+// On io_uring a connection is driven again once a poll, receive or send
+// completes, or right away when it can write and the send buffer has room
+static void async_uring_update(AsyncConnection *conn)
+{
+    UringIO *io = &conn->io;
+
+    // Without the poll nothing would ever tell when the connect finished
+    if (conn->state == ASYNC_CONNECTING)
+    {
+        if (!io->pollBusy && uring_poll(&conn->transport, POLLOUT))
+            async_fail(conn);
+        return;
+    }
+
+    if ((io->sendEnd < URING_SEND_SIZE && async_wants_write(conn)) || io->recvStart < io->recvEnd)
+    {
+        async_make_ready(conn);
+        return;
+    }
+
+    if (!io->recvBusy && !io->failed && uring_recv(&conn->transport))
+        io->failed = 1;
+
+    if (io->failed)
+        async_make_ready(conn);
+}
+
+static void async_update_events(AsyncConnection *conn)
+{
+    int events = EPOLLIN;
+
+    if (conn->engine->backend == SMTP_ENGINE_IO_URING)
+    {
+        async_uring_update(conn);
+        return;
+    }
+
+    if (conn->state == ASYNC_CONNECTING || async_wants_write(conn))
+        events |= EPOLLOUT;
+
+    if (events != conn->events)
+    {
+        struct epoll_event event = {.events = events, .data.ptr = conn};
+
+        epoll_ctl(conn->engine->epollfd, EPOLL_CTL_MOD, conn->transport.fd, &event);
+        conn->events = events;
+    }
+}
+
+static int async_connect_next(AsyncConnection *conn);
+
+// Runs the connection as far as it can go without blocking
+static void async_drive(AsyncConnection *conn)
+{
+    if (conn->state == ASYNC_CONNECTING)
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        struct sockaddr_storage peer;
+        socklen_t peerLength = sizeof(peer);
+
+        // A wakeup before the connect finished leaves no error but no peer
+        getsockopt(conn->transport.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (!error && getpeername(conn->transport.fd, (struct sockaddr*)&peer, &peerLength) && errno == ENOTCONN)
+        {
+            async_update_events(conn);
+            return;
+        }
+
+        if (error)
+        {
+            if (conn->engine->backend == SMTP_ENGINE_EPOLL)
+                epoll_ctl(conn->engine->epollfd, EPOLL_CTL_DEL, conn->transport.fd, NULL);
+
+            transport_close(&conn->transport, 0);
+            conn->address = conn->address->ai_next;
+
+            if (async_connect_next(conn))
+                async_fail(conn);
+            return;
+        }
+
+        conn->lastActivity = time(NULL);
+
+        if (conn->client.port != 465)
+            async_enter(conn, ASYNC_GREETING);
+        else if (async_start_tls(conn))
+        {
+            async_fail(conn);
+            return;
+        }
+    }
+
+    // Bounded so one fast connection cannot starve the others
+    for (int round = 0; round < 16; round++)
+    {
+        int progress = 0;
+
+        if (conn->state == ASYNC_HANDSHAKE)
+        {
+            int ret = async_handshake(conn);
+            if (ret < 0)
+            {
+                async_fail(conn);
+                return;
+            }
+
+            if (ret == 0)
+                break;
+        }
+
+        if (async_fill(conn))
+        {
+            // Closing after our QUIT is the normal end of the dialog
+            if (conn->state == ASYNC_QUIT || conn->state == ASYNC_DONE)
+                async_complete(conn, conn->rejected ? -1 : 0);
+            else
+                async_fail(conn);
+            return;
+        }
+
+        size_t unparsed = conn->inLength;
+
+        while (conn->state != ASYNC_HANDSHAKE && conn->state != ASYNC_DONE)
+        {
+            int ret = reply_parse(&conn->parser, conn->in, &conn->inLength, sizeof(conn->in), conn->engine->enableLogs,
+                                  conn->state == ASYNC_EHLO ? parse_capability : NULL, &conn->capabilities);
+            if (ret == 0)
+                break;
+
+            if (ret < 0 || async_reply(conn, conn->parser.reply.code))
+            {
+                async_fail(conn);
+                return;
+            }
+        }
+
+        // Includes pieces of an overlong line, which free the buffer for more
+        if (conn->inLength < unparsed)
+            progress = 1;
+
+        if (conn->state == ASYNC_DONE)
+        {
+            async_complete(conn, conn->rejected ? -1 : 0);
+            return;
+        }
+
+        if (conn->state == ASYNC_CONTENT && async_produce(conn))
+        {
+            async_fail(conn);
+            return;
+        }
+
+        long written = async_flush(conn);
+        if (written < 0)
+        {
+            async_fail(conn);
+            return;
+        }
+
+        if (conn->state == ASYNC_HANDSHAKE)
+            progress = 1;
+        else if (written > 0 && conn->state == ASYNC_CONTENT && !conn->wantWrite)
+            progress = 1;
+
+        if (!progress)
+            break;
+    }
+
+    async_update_events(conn);
+}
+
+// Connects the socket and waits for it with a one-shot poll on the ring
+static int async_uring_connect(AsyncConnection *conn, struct addrinfo *ai)
+{
+    UringIO *io = &conn->io;
+
+    if (!io->sendBuffer && !(io->sendBuffer = smtp_malloc(URING_SEND_SIZE)))
+        return -1;
+
+    if (!io->recvBuffer && !(io->recvBuffer = smtp_malloc(URING_RECV_SIZE)))
+        return -1;
+
+    if (connect(conn->transport.fd, ai->ai_addr, ai->ai_addrlen) != 0 && errno != EINPROGRESS)
+        return -1;
+
+    io->ring = &conn->engine->ring;
+    io->failed = io->closed = 0;
+    io->sendStart = io->sendEnd = io->recvStart = io->recvEnd = 0;
+    conn->transport.uring = io;
+
+    if (uring_poll(&conn->transport, POLLOUT))
+        return -1;
+
+    conn->transport.ops = &uringTransport;
+    conn->state = ASYNC_CONNECTING;
+    conn->stateSince = metrics_now();
+    conn->lastActivity = time(NULL);
+    return 0;
+}
+
+static int async_connect_next(AsyncConnection *conn)
+{
+    for (; conn->address; conn->address = conn->address->ai_next)
+    {
+        struct addrinfo *ai = conn->address;
+
+        conn->transport.fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (conn->transport.fd < 0)
+            continue;
+
+        setsockopt(conn->transport.fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+        if (conn->engine->backend == SMTP_ENGINE_IO_URING)
+        {
+            if (async_uring_connect(conn, ai) == 0)
+                return 0;
+        }
+        else if (connect(conn->transport.fd, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS)
+        {
+            struct epoll_event event = {.events = EPOLLIN | EPOLLOUT, .data.ptr = conn};
+
+            if (epoll_ctl(conn->engine->epollfd, EPOLL_CTL_ADD, conn->transport.fd, &event) == 0)
+            {
+                conn->transport.ops = &socketTransport;
+                conn->events = event.events;
+                conn->state = ASYNC_CONNECTING;
+                conn->stateSince = metrics_now();
+                conn->lastActivity = time(NULL);
+                return 0;
+            }
+        }
+
+        close(conn->transport.fd);
+        conn->transport.fd = -1;
+    }
+
+    return -1;
+}
+
+SMTPEngine* smtp_engine_create(int enableLogs)
+{
+    return smtp_engine_create_backend(enableLogs, SMTP_ENGINE_EPOLL);
+}
+
+// Kernels without io_uring, or where it is turned off, get epoll instead
+SMTPEngine* smtp_engine_create_backend(int enableLogs, SMTPEngineBackend backend)
+{
+    ignore_sigpipe();
+
+    SMTPEngine *engine = smtp_calloc(1, sizeof(SMTPEngine));
+    if (!engine)
+        return NULL;
+
+    engine->backend = SMTP_ENGINE_EPOLL;
+    engine->epollfd = -1;
+
+    if (backend == SMTP_ENGINE_IO_URING && uring_setup(&engine->ring) == 0)
+        engine->backend = SMTP_ENGINE_IO_URING;
+    else if ((engine->epollfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        free(engine);
+        return NULL;
+    }
+
+    engine->enableLogs = enableLogs;
+    engine->timeoutSeconds = 300;
+    engine->lastSweep = time(NULL);
+
+    return engine;
+}
+
+int smtp_engine_submit(SMTPEngine *engine, SMTPClient client, MailMessage *message, SMTPCompletionCallback callback, void *userData)
+{
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    char port[10] = {0};
+
+    if (client.port != 465 && client.port != 587 && client.port != 2525)
+        return -1;
+
+    if (!message->recipientList.numberOfElements)
+        return -1;
+
+    Capabilities known;
+    size_t estimate;
+
+    if (message_check_attachments(message, &estimate))
+        return -1;
+
+    // Refused up front when the server announced a smaller limit before
+    if (!capability_cache_find(&client, &known) && capability_too_large(&known, estimate))
+        return -1;
+
+    AsyncConnection *conn = async_acquire(engine);
+    if (!conn)
+        return -1;
+
+    conn->engine = engine;
+    conn->client = client;
+    conn->message = message;
+    conn->callback = callback;
+    conn->userData = userData;
+    conn->estimate = estimate;
+    conn->transport.fd = -1;
+
+    // Name resolution still blocks; everything after it is driven by the loop
+    uint64_t started = metrics_now();
+
+    sprintf(port, "%d", client.port);
+    if (getaddrinfo(client.mailServer, port, &hints, &conn->addresses) != 0)
+    {
+        async_release(engine, conn);
+        return -1;
+    }
+
+    metrics_record(SMTP_PHASE_DNS, started, 0);
+
+    conn->address = conn->addresses;
+    if (async_connect_next(conn))
+    {
+        freeaddrinfo(conn->addresses);
+        async_release(engine, conn);
+        return -1;
+    }
+
+    conn->next = engine->connections;
+    if (engine->connections)
+        engine->connections->prev = conn;
+    engine->connections = conn;
+    engine->inFlight++;
+
+    return 0;
+}
+
+SMTPEngineBackend smtp_engine_get_backend(SMTPEngine *engine)
+{
+    return engine->backend;
+}
+
+// Takes in every completion the kernel posted, marking their connections ready
+static void async_uring_reap(SMTPEngine *engine)
+{
+    Uring *ring = &engine->ring;
+    unsigned head = *ring->cqHead;
+    unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cqMask];
+        UringIO *io = (UringIO*)(uintptr_t)(cqe->user_data & ~(uint64_t)3);
+        AsyncConnection *conn = (AsyncConnection*)((char*)io - offsetof(AsyncConnection, io));
+        int kind = cqe->user_data & 3;
+        int res = cqe->res;
+
+        io->pending--;
+
+        if (kind == URING_POLL)
+            io->pollBusy = 0;
+        else if (kind == URING_RECV)
+        {
+            io->recvBusy = 0;
+
+            if (res > 0)
+            {
+                io->recvStart = 0;
+                io->recvEnd = res;
+            }
+            else if (res != -ECANCELED)
+                io->failed = 1;
+        }
+        else if (kind == URING_SEND)
+        {
+            io->sendBusy = 0;
+
+            if (res < 0)
+                io->failed = 1;
+            else
+                io->sendStart += res;
+
+            // What came in while it was on its way goes out next
+            if (io->sendStart == io->sendEnd || io->failed)
+                io->sendStart = io->sendEnd = 0;
+            else if (!io->closed)
+            {
+                memmove(io->sendBuffer, io->sendBuffer + io->sendStart, io->sendEnd - io->sendStart);
+                io->sendEnd -= io->sendStart;
+                io->sendStart = 0;
+
+                if (uring_send(&conn->transport))
+                    io->failed = 1;
+            }
+        }
+
+        if (conn->closing)
+        {
+            if (!io->pending)
+                async_release(engine, conn);
+        }
+        else if (kind != URING_CANCEL)
+            async_make_ready(conn);
+    }
+
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+// One io_uring_enter() per round submits everything queued since the last one
+// and waits for completions, unless connections are ready already
+static void async_uring_run(SMTPEngine *engine, int timeoutMs)
+{
+    uring_enter(&engine->ring, !engine->ready, timeoutMs);
+    async_uring_reap(engine);
+
+    AsyncConnection *conn = engine->ready;
+
+    engine->ready = NULL;
+
+    while (conn)
+    {
+        AsyncConnection *next = conn->readyNext;
+
+        conn->ready = 0;
+        async_drive(conn);
+        conn = next;
+    }
+
+    // Connections closed above mostly have their cancellations back already,
+    // which frees them for the next submission
+    if (engine->closing)
+        async_uring_reap(engine);
+}
+
+int smtp_engine_run(SMTPEngine *engine, int timeoutMs)
+{
+    if (engine->backend == SMTP_ENGINE_IO_URING)
+        async_uring_run(engine, timeoutMs);
+    else
+    {
+        struct epoll_event events[256];
+
+        int count = epoll_wait(engine->epollfd, events, 256, timeoutMs);
+
+        for (int i = 0; i < count; i++)
+            async_drive(events[i].data.ptr);
+    }
+
+    time_t now = time(NULL);
+    if (now != engine->lastSweep)
+    {
+        AsyncConnection *conn = engine->connections;
+
+        engine->lastSweep = now;
+
+        while (conn)
+        {
+            AsyncConnection *next = conn->next;
+
+            if (now - conn->lastActivity > engine->timeoutSeconds)
+                async_fail(conn);
+
+            conn = next;
+        }
+    }
+
+    return engine->inFlight;
+}
+
+// Messages still in flight complete with -1
+void smtp_engine_destroy(SMTPEngine *engine)
+{
+    if (!engine)
+        return;
+
+    while (engine->connections)
+        async_fail(engine->connections);
+
+    // Cancelled operations still have to come back before the ring goes
+    while (engine->closing)
+    {
+        if (uring_enter(&engine->ring, 1, -1))
+            break;
+
+        async_uring_reap(engine);
+    }
+
+    while (engine->spare)
+    {
+        AsyncConnection *next = engine->spare->next;
+
+        arena_free(&engine->spare->arena);
+        free(engine->spare->out);
+        free(engine->spare->io.sendBuffer);
+        free(engine->spare->io.recvBuffer);
+        free(engine->spare);
+        engine->spare = next;
+    }
+
+    if (engine->backend == SMTP_ENGINE_IO_URING)
+        uring_teardown(&engine->ring);
+    else
+        close(engine->epollfd);
+
+    free(engine);
+}
+
+// Spool file records. The checksum covers the header and the payload, so a
+// record torn by a crash is detected and cut off when the spool is reopened.
+#define SPOOL_MAGIC 0x31515053
+#define SPOOL_MAX_RECORD (1 << 24)
+
+enum
+{
+    SPOOL_RECORD_MESSAGE = 'M',
+    SPOOL_RECORD_DELIVERED = 'D',
+    SPOOL_RECORD_FAILED = 'F',
+    SPOOL_RECORD_RETRY = 'R'
+};
+
+typedef struct SpoolRecordHeader SpoolRecordHeader;
+struct SpoolRecordHeader
+{
+    uint32_t magic;
+    uint32_t type;
+    uint64_t id;
+    uint32_t length;
+    uint32_t checksum;
+};
+
+// A message still waiting in the spool file
+typedef struct SpoolEntry SpoolEntry;
+struct SpoolEntry
+{
+    uint64_t id;
+    off_t offset;           // of the serialized message
+    uint32_t length;
+    int attempts;
+    time_t nextAttempt;
+    int inFlight;
+    char *deferred;         // serialized recipients a 4xx put off, until recorded
+    uint32_t deferredLength;
+    SpoolEntry *prev;
+    SpoolEntry *next;
+};
+
+struct SMTPSpool
+{
+    SMTPClient client;
+    SMTPSpoolConfig config;
+    SMTPCompletionCallback callback;
+    void *userData;
+
+    int fd;
+    off_t writtenOffset;
+    off_t syncedOffset;
+    int syncing;
+    uint64_t nextId;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;         // messages arrived, finished or the spool is closing
+    pthread_cond_t synced;
+    SpoolEntry *head;
+    SpoolEntry *tail;
+    int stopping;
+    pthread_t *workers;
+    int workersStarted;
+    SMTPSpoolStats stats;
+};
+
+static uint32_t spool_checksum(SpoolRecordHeader *header, const char *payload)
+{
+    SpoolRecordHeader copy = *header;
+    const unsigned char *bytes = (const unsigned char*)&copy;
+    uint32_t hash = 2166136261u;
+
+    copy.checksum = 0;
+
+    for (size_t i = 0; i < sizeof(copy); i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+
+    for (uint32_t i = 0; i < header->length; i++)
+        hash = (hash ^ (unsigned char)payload[i]) * 16777619u;
+
+    return hash;
+}
+
+static void spool_put_int(char **p, uint32_t value)
+{
+    memcpy(*p, &value, sizeof(value));
+    *p += sizeof(value);
+}
+
+static void spool_put_string(char **p, SMTPString *value)
+{
+    spool_put_int(p, value->length);
+    memcpy(*p, value->data, value->length);
+    *p += value->length;
+}
+
+static int spool_get_int(const char **p, const char *end, uint32_t *value)
+{
+    if (end - *p < (ptrdiff_t)sizeof(*value))
+        return -1;
+
+    memcpy(value, *p, sizeof(*value));
+    *p += sizeof(*value);
+    return 0;
+}
+
+// Copies the next string into the message's arena
+static int spool_get_string(const char **p, const char *end, MailMessage *message, SMTPString *dest)
+{
+    uint32_t length;
+
+    if (spool_get_int(p, end, &length) || end - *p < (ptrdiff_t)length)
+        return -1;
+
+    if (arena_string(message->arena, dest, *p, length))
+        return -1;
+
+    *p += length;
+    return 0;
+}
+
+static char* spool_serialize(MailMessage *message, uint32_t *length)
+{
+    size_t capacity = 5 * sizeof(uint32_t) + message->subject.length + message->body.length;
+
+    for (RecipientListNode* current = message->recipientList.head; current; current = current->next)
+        capacity += 2 * sizeof(uint32_t) + current->recipient.emailAdress.length;
+
+    for (AttachementListNode* current = message->attachementList.head; current; current = current->next)
+        capacity += 2 * sizeof(uint32_t) + current->attachement.fileName.length + current->attachement.filePath.length;
+
+    if (capacity > SPOOL_MAX_RECORD)
+        return NULL;
+
+    char *buffer = smtp_malloc(capacity);
+    if (!buffer)
+        return NULL;
+
+    char *p = buffer;
+
+    spool_put_int(&p, message->isBodyHtml);
+    spool_put_string(&p, &message->subject);
+    spool_put_string(&p, &message->body);
+
+    spool_put_int(&p, message->recipientList.numberOfElements);
+
+    for (RecipientListNode* current = message->recipientList.head; current; current = current->next)
+    {
+        spool_put_int(&p, current->recipient.type);
+        spool_put_string(&p, &current->recipient.emailAdress);
+    }
+
+    spool_put_int(&p, message->attachementList.numberOfElements);
+
+    for (AttachementListNode* current = message->attachementList.head; current; current = current->next)
+    {
+        spool_put_string(&p, &current->attachement.fileName);
+        spool_put_string(&p, &current->attachement.filePath);
+    }
+
+    *length = p - buffer;
+    return buffer;
+}
+
+// Fills an empty message, whose arena may also hold buffer
+static int spool_deserialize(const char *buffer, uint32_t length, MailMessage *message)
+{
+    const char *p = buffer;
+    const char *end = buffer + length;
+    AttachementListNode **attachmentTail = &message->attachementList.head;
+    uint32_t value, count;
+
+    if (spool_get_int(&p, end, &value))
+        return -1;
+
+    message->isBodyHtml = value;
+
+    if (spool_get_string(&p, end, message, &message->subject) || spool_get_string(&p, end, message, &message->body)
+        || spool_get_int(&p, end, &count))
+        return -1;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        RecipientListNode *node = arena_alloc(message->arena, sizeof(RecipientListNode));
+
+        if (!node || spool_get_int(&p, end, &value) || spool_get_string(&p, end, message, &node->recipient.emailAdress))
+            return -1;
+
+        node->recipient.type = value;
+        node->recipient.status = 0;
+        node->next = NULL;
+
+        if (message->recipientList.tail)
+            message->recipientList.tail->next = node;
+        else
+            message->recipientList.head = node;
+
+        message->recipientList.tail = node;
+        message->recipientList.numberOfElements++;
+    }
+
+    if (spool_get_int(&p, end, &count))
+        return -1;
+
+    // Appended, so the list keeps the order it was serialized in
+    for (uint32_t i = 0; i < count; i++)
+    {
+        AttachementListNode *node = arena_alloc(message->arena, sizeof(AttachementListNode));
+        if (!node)
+            return -1;
+
+        node->next = NULL;
+        *attachmentTail = node;
+        attachmentTail = &node->next;
+        message->attachementList.numberOfElements++;
+
+        if (spool_get_string(&p, end, message, &node->attachement.fileName)
+            || spool_get_string(&p, end, message, &node->attachement.filePath))
+            return -1;
+    }
+
+    return 0;
+}
+
+// Called with spool->lock held. Appends one record and, for messages,
+// returns where its payload starts.
+static int spool_append(SMTPSpool *spool, int type, uint64_t id, const char *payload, uint32_t length, off_t *payloadOffset)
+{
+    SpoolRecordHeader header = { SPOOL_MAGIC, type, id, length, 0 };
+    header.checksum = spool_checksum(&header, payload);
+
+    struct iovec parts[2] = { { &header, sizeof(header) }, { (void*)payload, length } };
+    size_t total = sizeof(header) + length;
+    size_t written = 0;
+
+    while (written < total)
+    {
+        ssize_t ret;
 
-    fseek(file, 0, SEEK_END);
-    *length = ftell(file);
-    fseek(file, 0, SEEK_SET);
+        if (written < sizeof(header))
+        {
+            struct iovec rest[2] = { { (char*)&header + written, sizeof(header) - written }, parts[1] };
+            ret = pwritev(spool->fd, rest, length ? 2 : 1, spool->writtenOffset + written);
+        }
+        else
+            ret = pwrite(spool->fd, payload + written - sizeof(header), total - written, spool->writtenOffset + written);
 
-    unsigned char* content = malloc(*length + 1);
-    fread(content, 1, *length, file);
-    fclose(file);
+        if (ret < 0 && errno == EINTR)
+            continue;
 
-    int is_text = 1;
-    for (size_t i = 0; i < *length; i++) {
-        if (content[i] == 0) {
-            is_text = 0;
-            break;
+        if (ret <= 0)
+        {
+            // Never leave half a record behind
+            if (ftruncate(spool->fd, spool->writtenOffset)) {}
+            return -1;
         }
-    }
 
-    if (is_text) {
-        content[*length] = '\0';
+        written += ret;
     }
 
-    return content;
+    if (payloadOffset)
+        *payloadOffset = spool->writtenOffset + sizeof(header);
+
+    spool->writtenOffset += total;
+    return 0;
 }
 
-static void base64_encode(char* dest, char* src)
+// Called with spool->lock held. Returns once everything up to offset is on
+// disk. Whoever finds no sync running starts one for every record written so
+// far, so writers that arrive meanwhile share the next one. SPOOL_SYNC_EACH
+// shares nothing: each caller waits its turn and syncs on its own.
+static int spool_sync(SMTPSpool *spool, off_t offset)
 {
-    BIO *bio, *b64;
-    BUF_MEM *bufferPtr;
+    int own = spool->config.syncPolicy == SPOOL_SYNC_EACH;
 
-    b64 = BIO_new(BIO_f_base64());
-    bio = BIO_new(BIO_s_mem());
-    bio = BIO_push(b64, bio);
-
-    BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
+    while (own || spool->syncedOffset < offset)
+    {
+        if (spool->syncing)
+        {
+            pthread_cond_wait(&spool->synced, &spool->lock);
+            continue;
+        }
 
-    BIO_write(bio, src, strlen(src));
-    BIO_flush(bio);
+        spool->syncing = 1;
 
-    BIO_get_mem_ptr(bio, &bufferPtr);
-    strcpy(dest, bufferPtr->data);
+        if (spool->config.syncPolicy == SPOOL_SYNC_GROUP && spool->config.groupCommitMicroseconds > 0)
+        {
+            pthread_mutex_unlock(&spool->lock);
+            usleep(spool->config.groupCommitMicroseconds);
+            pthread_mutex_lock(&spool->lock);
+        }
 
-    BIO_free_all(bio);
-}
+        off_t target = spool->writtenOffset;
 
-void base64_encode_file(unsigned char* dest, const unsigned char* src, size_t src_len) {
-    BIO *bio, *b64;
-    BUF_MEM *bufferPtr;
+        pthread_mutex_unlock(&spool->lock);
+        int ret = fdatasync(spool->fd);
+        pthread_mutex_lock(&spool->lock);
 
-    b64 = BIO_new(BIO_f_base64());
-    bio = BIO_new(BIO_s_mem());
-    bio = BIO_push(b64, bio);
+        spool->syncing = 0;
+        own = 0;
+        pthread_cond_broadcast(&spool->synced);
 
-    BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
-    BIO_write(bio, src, src_len);  // Use actual length, not strlen()
-    BIO_flush(bio);
+        if (ret)
+            return -1;
 
-    BIO_get_mem_ptr(bio, &bufferPtr);
-    memcpy(dest, bufferPtr->data, bufferPtr->length);
-    dest[bufferPtr->length] = '\0';
+        spool->stats.syncs++;
+        if (target > spool->syncedOffset)
+            spool->syncedOffset = target;
+    }
 
-    BIO_free_all(bio);
+    return 0;
 }
 
-void insert_attachement(MailMessage *message, Attachement attachement)
+// Called with spool->lock held when an outcome could not be recorded. The
+// message then counts as pending again after the next smtp_spool_open().
+static void spool_write_failed(SMTPSpool *spool, uint64_t id)
 {
-    AttachementListNode* new = malloc(sizeof(AttachementListNode));
-    strcpy(new->attachement.fileName, attachement.fileName);
-    strcpy(new->attachement.filePath, attachement.filePath);
+    spool->stats.writeErrors++;
+    log_format(SMTP_LOG_ERROR, SMTP_LOG_SPOOL, "message %llu: outcome not written to the spool: %s\n", (unsigned long long)id, strerror(errno));
+}
 
-    new->next = (*message).attachementList.head;
-    (*message).attachementList.head = new;
+static SpoolEntry* spool_find(SMTPSpool *spool, uint64_t id)
+{
+    for (SpoolEntry *entry = spool->head; entry; entry = entry->next) {
+        if (entry->id == id)
+            return entry;
+    }
 
-    ((*message).attachementList.numberOfElements)++;
+    return NULL;
 }
 
-void send_email(SMTPClient client, MailMessage message, int enableLogs)
+static void spool_push(SMTPSpool *spool, SpoolEntry *entry)
 {
-    char buffer[4096];
-    char req[4096];
+    entry->prev = spool->tail;
+    entry->next = NULL;
 
-    int clientfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (spool->tail)
+        spool->tail->next = entry;
+    else
+        spool->head = entry;
 
-    struct sockaddr_in smtp_server_addr;
-    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
-    struct addrinfo *res;
+    spool->tail = entry;
+    spool->stats.pending++;
+}
 
-    char port[10] = {0};
-    sprintf(port, "%d", client.port);
+static void spool_remove(SMTPSpool *spool, SpoolEntry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        spool->head = entry->next;
 
-    char dateStr[128];
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        spool->tail = entry->prev;
 
-    time_t now = time(NULL);
-    struct tm *tm_info = gmtime(&now);
+    spool->stats.pending--;
+    free(entry);
+}
 
-    strftime(dateStr, sizeof(dateStr), "%a, %d %b %Y %H:%M:%S +0000", tm_info);
+// Rebuilds the list of undelivered messages from the file, cutting off a
+// torn record at the end
+static int spool_replay(SMTPSpool *spool)
+{
+    off_t offset = 0;
+    char *payload = NULL;
 
-    if (client.port == 25)
-    {
-        perror("Port 25 is no longer used");
-        exit(1);
-    }
-    else if (client.port == 465)
+    for (;;)
     {
-        getaddrinfo(client.mailServer, port, &hints, &res);
-        connect(clientfd, res->ai_addr, res->ai_addrlen);
-        freeaddrinfo(res);
+        SpoolRecordHeader header;
 
-        OPENSSL_init_ssl(0, NULL);
-        SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
-        SSL *ssl = SSL_new(ctx);
-        SSL_set_fd(ssl, clientfd);
+        if (pread(spool->fd, &header, sizeof(header), offset) != sizeof(header))
+            break;
 
-        SSL_connect(ssl);
+        if (header.magic != SPOOL_MAGIC || header.length > SPOOL_MAX_RECORD)
+            break;
 
-        if (enableLogs)
+        char *grown = smtp_realloc(payload, header.length ? header.length : 1);
+        if (!grown)
         {
-            SSL_read(ssl, buffer, sizeof(buffer));
-            printf("S: %s", buffer);
+            free(payload);
+            return -1;
         }
 
-        strcpy(req, "EHLO localhost\r\n");
+        payload = grown;
 
-        SSL_write(ssl, req, strlen(req));
-        if (enableLogs)
-        {
-            printf("C: %s", req);
-            SSL_read(ssl, buffer, sizeof(buffer));
-            printf("S: %s", buffer);
-        }
-
-        if (client.authType == LOGIN)
-        {
-            strcpy(req, "AUTH LOGIN\r\n");
-            SSL_write(ssl, req, strlen(req));
-            if (enableLogs)
-            {
-                printf("C: %s", req);
-                SSL_read(ssl, buffer, sizeof(buffer));
-                printf("S: %s", buffer);
-            }
+        if (pread(spool->fd, payload, header.length, offset + sizeof(header)) != (ssize_t)header.length
+            || spool_checksum(&header, payload) != header.checksum)
+            break;
 
-            base64_encode(req, client.emailAdress);
-            strcat(req, "\r\n");
-            SSL_write(ssl, req, strlen(req));
+        SpoolEntry *entry = header.type == SPOOL_RECORD_MESSAGE ? NULL : spool_find(spool, header.id);
 
-            if (enableLogs)
+        if (header.type == SPOOL_RECORD_MESSAGE)
+        {
+            entry = smtp_calloc(1, sizeof(SpoolEntry));
+            if (!entry)
             {
-                printf("C: %s", req);
-                SSL_read(ssl, buffer, sizeof(buffer));
-                printf("S: %s", buffer);
+                free(payload);
+                return -1;
             }
 
-            base64_encode(req, client.secretCode);
-            strcat(req, "\r\n");
-            SSL_write(ssl, req, strlen(req));
-
-            if (enableLogs)
-            {
-                printf("C: %s", req);
-                SSL_read(ssl, buffer, sizeof(buffer));
-                printf("S: %s", buffer);
-            }
+            entry->id = header.id;
+            entry->offset = offset + sizeof(header);
+            entry->length = header.length;
+            spool_push(spool, entry);
         }
-        else
+        else if (entry && header.type == SPOOL_RECORD_RETRY && header.length >= sizeof(uint32_t) + sizeof(int64_t))
         {
-            const char xoauth2_prefix[] = "AUTH XOAUTH2 ";
-            char temp[4069] = {0};
-
-            snprintf(temp, sizeof(temp), "user=%s%cauth=Bearer %s\%c%c", client.emailAdress,  0x01, client.secretCode, 0x01, 0x01);
-            printf("%s\n", temp);
-            BIO *bio, *b64;
-            BUF_MEM *bufferPtr;
-
-            b64 = BIO_new(BIO_f_base64());
-            bio = BIO_new(BIO_s_mem());
-            bio = BIO_push(b64, bio);
-
-            BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
+            uint32_t attempts;
+            int64_t nextAttempt;
 
-            BIO_write(bio, temp, strlen(temp));
-            BIO_flush(bio);
+            memcpy(&attempts, payload, sizeof(attempts));
+            memcpy(&nextAttempt, payload + sizeof(attempts), sizeof(nextAttempt));
+            entry->attempts = attempts;
+            entry->nextAttempt = nextAttempt;
 
-            BIO_get_mem_ptr(bio, &bufferPtr);
-            memcpy(req, bufferPtr->data, bufferPtr->length);
-            req[bufferPtr->length] = '\0';
-
-            BIO_free_all(bio);
-            printf("%s\n", req);
-            strcat(req, "\r\n");
-            sprintf(temp, "%s%s", xoauth2_prefix, req);
-            SSL_write(ssl, temp, strlen(temp));
-
-            if (enableLogs)
+            // After a partial delivery only the deferred recipients are left
+            if (header.length > sizeof(uint32_t) + sizeof(int64_t))
             {
-                printf("C: %s", temp);
-                SSL_read(ssl, buffer, sizeof(buffer));
-                printf("S: %s", buffer);
+                entry->offset = offset + sizeof(header) + sizeof(uint32_t) + sizeof(int64_t);
+                entry->length = header.length - sizeof(uint32_t) - sizeof(int64_t);
             }
         }
+        else if (entry && (header.type == SPOOL_RECORD_DELIVERED || header.type == SPOOL_RECORD_FAILED))
+            spool_remove(spool, entry);
 
-        sprintf(req, "MAIL FROM: <%s>\r\n", client.emailAdress);
-        SSL_write(ssl, req, strlen(req));
-
-        if (enableLogs)
-        {
-            printf("C: %s", req);
-            SSL_read(ssl, buffer, sizeof(buffer));
-            printf("S: %s", buffer);
-        }
+        if (header.id >= spool->nextId)
+            spool->nextId = header.id + 1;
 
-        sprintf(req, "RCPT TO: <%s>\r\n", message.receiverEmailAdress);
-        SSL_write(ssl, req, strlen(req));
+        offset += sizeof(header) + header.length;
+    }
 
-        if (enableLogs)
-        {
-            printf("C: %s", req);
-            SSL_read(ssl, buffer, sizeof(buffer));
-            printf("S: %s", buffer);
-        }
+    free(payload);
 
-        strcpy(req, "DATA\r\n");
-        SSL_write(ssl, req, strlen(req));
+    if (!spool->head)
+        offset = 0;
 
-        if (enableLogs)
-        {
-            printf("C: %s", req);
-            SSL_read(ssl, buffer, sizeof(buffer));
-            printf("S: %s", buffer);
-        }
-
-        if (!message.attachementList.numberOfElements)
-        {
-            sprintf(req,"Date: %s\r\n"
-                        "From: <%s>\r\n"
-                        "To: Recipient <%s>\r\n"
-                        "MIME-Version: 1.0\r\n"
-                        "Content-Type: text/%s; charset=\"ISO-8859-1\"\r\n"
-                        "Subject: %s\r\n\r\n"
-                        "%s\r\n.\r\n",
-                        dateStr,
-                        client.emailAdress,
-                        message.receiverEmailAdress,
-                        message.isBodyHtml? "html" : "plain",
-                        message.subject,
-                        message.body);
-
-            SSL_write(ssl, req, strlen(req));
-            if (enableLogs)
-            {
-                printf("C: %s", req);
-                SSL_read(ssl, buffer, sizeof(buffer));
-                printf("S: %s", buffer);
-            }
-        }
-        else
-        {
-            sprintf(req,"Date: %s\r\n"
-                        "From: <%s>\r\n"
-                        "To: Recipient <%s>\r\n"
-                        "MIME-Version: 1.0\r\n"
-                        "Content-Type: multipart/mixed; boundary=\"123456789\"\r\n"
-                        "Subject: %s\r\n\r\n"
-                        "--123456789\r\n"
-                        "Content-Type: text/%s; charset=\"ISO-8859-1\"\r\n"
-                        "Content-Transfer-Encoding: quoted-printable\r\n\r\n"
-                        "%s\r\n\r\n"
-                        "--123456789\r\n",
-                        dateStr,
-                        client.emailAdress,
-                        message.receiverEmailAdress,
-                        message.subject,
-                        message.isBodyHtml? "html" : "plain",
-                        message.body);
-            SSL_write(ssl, req, strlen(req));
-
-            AttachementListNode* current = message.attachementList.head;
-            unsigned char *file;
-            size_t* length = malloc(sizeof(size_t));
-
-            unsigned char *encoded_file;
-            size_t encoded_length;
-
-            for (int i = 0; i < message.attachementList.numberOfElements; i++)
-            {
-                sprintf(req,"Content-Disposition: attachment; filename=\"%s\"\r\n"
-                            "Content-Type: %s; name=\"%s\"\r\n"
-                            "Content-Transfer-Encoding: base64\r\n\r\n",
-                            (current->attachement).fileName,
-                            get_mime_type((current->attachement).fileName),
-                            (current->attachement).fileName
-                );
+    if (ftruncate(spool->fd, offset))
+        return -1;
 
-                size_t total_sent;
-                SSL_write(ssl, req, strlen(req));
+    spool->writtenOffset = spool->syncedOffset = offset;
+    return 0;
+}
 
-                file = read_file((current->attachement).filePath, length);
+// 4xx replies and lost connections are worth another attempt, 5xx are final
+static int spool_transient(SMTPSession *session, MailMessage *message)
+{
+    int rejected = 0;
 
-                encoded_length = 4 * ceil((*length) / 3);
+    for (RecipientListNode* current = message->recipientList.head; current; current = current->next)
+    {
+        int status = current->recipient.status;
 
-                encoded_file = malloc(encoded_length + 1);
+        if (status >= 400 && status < 500)
+            return 1;
 
-                base64_encode_file(encoded_file, file, *length);
+        if (status >= 500)
+            rejected++;
+    }
 
-                free(file);
+    if (session && session->failureCode)
+        return session->failureCode < 500;
 
-                total_sent = 0;
-                while (total_sent < encoded_length) {
-                    int chunk = (encoded_length - total_sent > 16384)
-                                ? 16384
-                                : encoded_length - total_sent;
+    return !message->recipientList.numberOfElements || rejected < message->recipientList.numberOfElements;
+}
 
-                    int ret = SSL_write(ssl, encoded_file + total_sent, chunk);
-                    total_sent += ret;
-                }
+// Recipients the server put off with a 4xx reply to RCPT TO while accepting
+// the message for others
+static int spool_deferred_recipients(MailMessage *message)
+{
+    int count = 0;
 
-                free(encoded_file);
+    for (RecipientListNode* current = message->recipientList.head; current; current = current->next)
+    {
+        if (current->recipient.status >= 400 && current->recipient.status < 500)
+            count++;
+    }
 
-                sprintf(req,"\r\n\r\n"
-                            "--123456789\r\n");
-                SSL_write(ssl, req, strlen(req));
+    return count;
+}
 
-                current = current->next;
-            }
+// Cuts the message down to its deferred recipients and keeps it serialized
+// for the retry record. Without memory the whole message is retried.
+static void spool_keep_deferred(SpoolEntry *entry, MailMessage *message)
+{
+    RecipientListNode **link = &message->recipientList.head;
 
-            sprintf(req,".\r\n");
-            SSL_write(ssl, req, strlen(req));
-            free(length);
-        }
+    message->recipientList.tail = NULL;
+    message->recipientList.numberOfElements = 0;
 
-        strcpy(req, "QUIT\r\n");
-        SSL_write(ssl, req, strlen(req));
+    while (*link)
+    {
+        int status = (*link)->recipient.status;
 
-        if (enableLogs)
+        if (status >= 400 && status < 500)
         {
-            printf("C: %s", req);
-            SSL_read(ssl, buffer, sizeof(buffer));
-            printf("S: %s", buffer);
+            message->recipientList.tail = *link;
+            message->recipientList.numberOfElements++;
+            link = &(*link)->next;
         }
-
-        SSL_free(ssl);
-        SSL_CTX_free(ctx);
-        close(clientfd);
+        else
+            *link = (*link)->next;
     }
-    else if(client.port == 587 || client.port == 2525)
+
+    entry->deferred = spool_serialize(message, &entry->deferredLength);
+}
+
+// Sends one spooled message. Returns 0 when delivered to every recipient, 1
+// to retry later and -1 when it failed for good. Recipients that were put
+// off are retried on their own, and the callback only runs once none are
+// left.
+// The payload and the message are built in the worker's message, which is
+// reset afterwards, so a warmed-up worker allocates nothing here.
+static int spool_deliver(SMTPSpool *spool, SpoolEntry *entry, SMTPSession **session, MailMessage *message)
+{
+    int result = -1;
+
+    char *payload = arena_alloc(message->arena, entry->length ? entry->length : 1);
+    if (!payload)
+        return 1;
+
+    if (pread(spool->fd, payload, entry->length, entry->offset) != (ssize_t)entry->length
+        || spool_deserialize(payload, entry->length, message))
     {
-        getaddrinfo(client.mailServer, port, &hints, &res);
-        connect(clientfd, res->ai_addr, res->ai_addrlen);
-        freeaddrinfo(res);
+        smtp_message_reset(message);
+        return -1;
+    }
 
-        send(clientfd, "EHLO localhost\r\n", 16, 0);
+    size_t estimate;
+    int partial = 0;
 
-        if (enableLogs)
-        {
-            printf("C: EHLO localhost\n");
-            recv(clientfd, buffer, sizeof(buffer), 0);
-            printf("S: %s", buffer);
-        }
+    if (message_check_attachments(message, &estimate))
+        result = -1;
+    else if (!*session && !(*session = smtp_session_open(spool->client, spool->config.enableLogs)))
+        result = 1;
+    else if (smtp_session_send(*session, message) == 0)
+        result = partial = spool_deferred_recipients(message) > 0;
+    else
+        result = spool_transient(*session, message) ? 1 : -1;
 
-        if (client.enableSSL)
-        {
-            printf("%d\n", message.attachementList.numberOfElements);
-            send(clientfd, "STARTTLS\r\n", 10, 0);
+    if (result == 1 && entry->attempts + 1 >= spool->config.maxAttempts)
+        result = -1;
+    else if (result == 1 && partial)
+        spool_keep_deferred(entry, message);
 
-            recv(clientfd, buffer, sizeof(buffer), 0);
+    if (result != 1 && spool->callback)
+        spool->callback(message, result, spool->userData);
 
-            while (!strstr(buffer, "220")) {
-                recv(clientfd, buffer, sizeof(buffer), 0);
-            }
+    smtp_message_reset(message);
+    return result;
+}
 
-            OPENSSL_init_ssl(0, NULL);
-            SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
-            SSL *ssl = SSL_new(ctx);
-            SSL_set_fd(ssl, clientfd);
+static void* spool_worker(void *arg)
+{
+    SMTPSpool *spool = arg;
+    SMTPSession *session = NULL;
+    SpoolEntry **batch = smtp_calloc(spool->config.batchSize, sizeof(SpoolEntry*));
+    int *results = smtp_calloc(spool->config.batchSize, sizeof(int));
+    MailMessage *message = smtp_message_create();
 
-            SSL_connect(ssl);
+    if (!batch || !results || !message)
+    {
+        free(batch);
+        free(results);
+        smtp_message_free(message);
+        return NULL;
+    }
 
-            if (enableLogs)
-            {
-                printf("C: STARTTLS\r\n");
-                printf("S: %s", buffer);
-            }
+    pthread_mutex_lock(&spool->lock);
 
-            strcpy(req, "EHLO localhost\r\n");
+    while (!spool->stopping)
+    {
+        time_t now = time(NULL);
+        time_t earliest = 0;
+        int count = 0;
 
-            SSL_write(ssl, req, strlen(req));
+        for (SpoolEntry *entry = spool->head; entry && count < spool->config.batchSize; entry = entry->next)
+        {
+            if (entry->inFlight)
+                continue;
 
-            if (enableLogs)
+            if (entry->nextAttempt <= now)
             {
-                printf("C: %s", req);
-                SSL_read(ssl, buffer, sizeof(buffer));
-                printf("S: %s", buffer);
+                entry->inFlight = 1;
+                batch[count++] = entry;
             }
+            else if (!earliest || entry->nextAttempt < earliest)
+                earliest = entry->nextAttempt;
+        }
 
-            if (client.authType == LOGIN)
+        if (!count)
+        {
+            // Nothing due, so the connection is not worth keeping
+            if (session)
             {
-                strcpy(req, "AUTH LOGIN\r\n");
-                SSL_write(ssl, req, strlen(req));
-                if (enableLogs)
-                {
-                    printf("C: %s", req);
-                    SSL_read(ssl, buffer, sizeof(buffer));
-                    printf("S: %s", buffer);
-                }
+                pthread_mutex_unlock(&spool->lock);
+                smtp_session_close(session);
+                session = NULL;
+                pthread_mutex_lock(&spool->lock);
+                continue;
+            }
 
-                base64_encode(req, client.emailAdress);
-                strcat(req, "\r\n");
-                SSL_write(ssl, req, strlen(req));
+            if (earliest)
+            {
+                struct timespec deadline = { earliest, 0 };
+                pthread_cond_timedwait(&spool->changed, &spool->lock, &deadline);
+            }
+            else
+                pthread_cond_wait(&spool->changed, &spool->lock);
 
-                if (enableLogs)
-                {
-                    printf("C: %s", req);
-                    SSL_read(ssl, buffer, sizeof(buffer));
-                    printf("S: %s", buffer);
-                }
+            continue;
+        }
 
-                base64_encode(req, client.secretCode);
-                strcat(req, "\r\n");
-                SSL_write(ssl, req, strlen(req));
+        pthread_mutex_unlock(&spool->lock);
 
-                if (enableLogs)
-                {
-                    printf("C: %s", req);
-                    SSL_read(ssl, buffer, sizeof(buffer));
-                    printf("S: %s", buffer);
-                }
-            }
+        for (int i = 0; i < count; i++)
+        {
+            // Once the relay is unreachable the rest of the batch waits too
+            if (i > 0 && results[i - 1] == 1 && !session)
+                results[i] = 1;
             else
+                results[i] = spool_deliver(spool, batch[i], &session, message);
+
+            if (session && !session->transport.ops)
             {
-                const char xoauth2_prefix[] = "AUTH XOAUTH2 ";
-                char temp[4069] = {0};
+                smtp_session_close(session);
+                session = NULL;
+            }
+        }
 
-                snprintf(temp, sizeof(temp), "user=%s%cauth=Bearer %s\%c%c", client.emailAdress,  0x01, client.secretCode, 0x01, 0x01);
-                printf("%s\n", temp);
-                BIO *bio, *b64;
-                BUF_MEM *bufferPtr;
+        pthread_mutex_lock(&spool->lock);
+        now = time(NULL);
+
+        for (int i = 0; i < count; i++)
+        {
+            SpoolEntry *entry = batch[i];
 
-                b64 = BIO_new(BIO_f_base64());
-                bio = BIO_new(BIO_s_mem());
-                bio = BIO_push(b64, bio);
+            if (results[i] == 1)
+            {
+                int shift = entry->attempts < 20 ? entry->attempts : 20;
+                long delay = (long)spool->config.initialBackoffSeconds << shift;
+                char payload[sizeof(uint32_t) + sizeof(int64_t)];
 
-                BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
+                if (delay > spool->config.maxBackoffSeconds)
+                    delay = spool->config.maxBackoffSeconds;
 
-                BIO_write(bio, temp, strlen(temp));
-                BIO_flush(bio);
+                entry->attempts++;
+                entry->nextAttempt = now + delay;
+                entry->inFlight = 0;
 
-                BIO_get_mem_ptr(bio, &bufferPtr);
-                memcpy(req, bufferPtr->data, bufferPtr->length);
-                req[bufferPtr->length] = '\0';
+                uint32_t attempts = entry->attempts;
+                int64_t nextAttempt = entry->nextAttempt;
+                memcpy(payload, &attempts, sizeof(attempts));
+                memcpy(payload + sizeof(attempts), &nextAttempt, sizeof(nextAttempt));
 
-                BIO_free_all(bio);
-                printf("%s\n", req);
-                strcat(req, "\r\n");
-                sprintf(temp, "%s%s", xoauth2_prefix, req);
-                SSL_write(ssl, temp, strlen(temp));
+                // The message with only its deferred recipients follows; until
+                // that is written the next attempt goes to all of them again
+                char *record = payload;
+                uint32_t recordLength = sizeof(payload);
+                off_t recordOffset;
 
-                if (enableLogs)
+                if (entry->deferred && (record = smtp_malloc(sizeof(payload) + entry->deferredLength)))
                 {
-                    printf("C: %s", temp);
-                    SSL_read(ssl, buffer, sizeof(buffer));
-                    printf("S: %s", buffer);
+                    memcpy(record, payload, sizeof(payload));
+                    memcpy(record + sizeof(payload), entry->deferred, entry->deferredLength);
+                    recordLength += entry->deferredLength;
                 }
-            }
-
-            sprintf(req, "MAIL FROM: <%s>\r\n", client.emailAdress);
-            SSL_write(ssl, req, strlen(req));
-
-            if (enableLogs)
-            {
-                printf("C: %s", req);
-                SSL_read(ssl, buffer, sizeof(buffer));
-                printf("S: %s", buffer);
-            }
-
-            sprintf(req, "RCPT TO: <%s>\r\n", message.receiverEmailAdress);
-            SSL_write(ssl, req, strlen(req));
+                else
+                    record = payload;
 
-            if (enableLogs)
-            {
-                printf("C: %s", req);
-                SSL_read(ssl, buffer, sizeof(buffer));
-                printf("S: %s", buffer);
-            }
+                if (spool_append(spool, SPOOL_RECORD_RETRY, entry->id, record, recordLength, &recordOffset))
+                    spool_write_failed(spool, entry->id);
+                else if (record != payload)
+                {
+                    entry->offset = recordOffset + sizeof(payload);
+                    entry->length = entry->deferredLength;
+                }
 
-            strcpy(req, "DATA\r\n");
-            SSL_write(ssl, req, strlen(req));
+                if (record != payload)
+                    free(record);
 
-            if (enableLogs)
-            {
-                printf("C: %s", req);
-                SSL_read(ssl, buffer, sizeof(buffer));
-                printf("S: %s", buffer);
-            }
+                free(entry->deferred);
+                entry->deferred = NULL;
 
-            if (!message.attachementList.numberOfElements)
-            {
-                sprintf(req,"Date: %s\r\n"
-                            "From: <%s>\r\n"
-                            "To: Recipient <%s>\r\n"
-                            "MIME-Version: 1.0\r\n"
-                            "Content-Type: text/%s; charset=\"ISO-8859-1\"\r\n"
-                            "Subject: %s\r\n\r\n"
-                            "%s\r\n.\r\n",
-                            dateStr,
-                            client.emailAdress,
-                            message.receiverEmailAdress,
-                            message.isBodyHtml? "html" : "plain",
-                            message.subject,
-                            message.body);
+                spool->stats.deferred++;
 
-                SSL_write(ssl, req, strlen(req));
-                if (enableLogs)
-                {
-                    printf("C: %s", req);
-                    SSL_read(ssl, buffer, sizeof(buffer));
-                    printf("S: %s", buffer);
-                }
+                if (spool->config.enableLogs)
+                    log_format(SMTP_LOG_INFO, SMTP_LOG_SPOOL, "message %llu deferred for %lds\n", (unsigned long long)entry->id, delay);
             }
             else
             {
-                sprintf(req,"Date: %s\r\n"
-                            "From: <%s>\r\n"
-                            "To: Recipient <%s>\r\n"
-                            "MIME-Version: 1.0\r\n"
-                            "Content-Type: multipart/mixed; boundary=\"123456789\"\r\n"
-                            "Subject: %s\r\n\r\n"
-                            "--123456789\r\n"
-                            "Content-Type: text/%s; charset=\"ISO-8859-1\"\r\n"
-                            "Content-Transfer-Encoding: quoted-printable\r\n\r\n"
-                            "%s\r\n\r\n"
-                            "--123456789\r\n",
-                            dateStr,
-                            client.emailAdress,
-                            message.receiverEmailAdress,
-                            message.subject,
-                            message.isBodyHtml? "html" : "plain",
-                            message.body);
-                SSL_write(ssl, req, strlen(req));
-
-                AttachementListNode* current = message.attachementList.head;
-                unsigned char *file;
-                size_t* length = malloc(sizeof(size_t));
+                if (spool_append(spool, results[i] == 0 ? SPOOL_RECORD_DELIVERED : SPOOL_RECORD_FAILED, entry->id, NULL, 0, NULL))
+                    spool_write_failed(spool, entry->id);
 
-                unsigned char *encoded_file;
-                size_t encoded_length;
-
-                for (int i = 0; i < message.attachementList.numberOfElements; i++)
+                if (results[i] == 0)
+                    spool->stats.delivered++;
+                else
                 {
-                    sprintf(req,"Content-Disposition: attachment; filename=\"%s\"\r\n"
-                                "Content-Type: %s; name=\"%s\"\r\n"
-                                "Content-Transfer-Encoding: base64\r\n\r\n",
-                                (current->attachement).fileName,
-                                get_mime_type((current->attachement).fileName),
-                                (current->attachement).fileName
-                    );
-
-                    size_t total_sent;
-                    SSL_write(ssl, req, strlen(req));
+                    spool->stats.failed++;
 
-                    file = read_file((current->attachement).filePath, length);
-
-                    encoded_length = 4 * ceil((*length) / 3);
+                    if (spool->config.enableLogs)
+                        log_format(SMTP_LOG_WARNING, SMTP_LOG_SPOOL, "message %llu failed permanently\n", (unsigned long long)entry->id);
+                }
 
-                    encoded_file = malloc(encoded_length + 1);
+                spool_remove(spool, entry);
+            }
+        }
 
-                    base64_encode_file(encoded_file, file, *length);
+        // One sync covers the outcome of the whole batch; a crash before it
+        // only means the batch is sent again
+        if (spool->config.syncPolicy != SPOOL_SYNC_NONE)
+            spool_sync(spool, spool->writtenOffset);
 
-                    free(file);
+        // Nothing left to deliver, so the whole file can go
+        if (!spool->head && !spool->syncing && ftruncate(spool->fd, 0) == 0)
+            spool->writtenOffset = spool->syncedOffset = 0;
 
-                    total_sent = 0;
-                    while (total_sent < encoded_length) {
-                        int chunk = (encoded_length - total_sent > 16384)
-                                    ? 16384
-                                    : encoded_length - total_sent;
+        pthread_cond_broadcast(&spool->changed);
+    }
 
-                        int ret = SSL_write(ssl, encoded_file + total_sent, chunk);
-                        total_sent += ret;
-                    }
+    pthread_mutex_unlock(&spool->lock);
 
-                    free(encoded_file);
+    if (session)
+        smtp_session_close(session);
 
-                    sprintf(req,"\r\n\r\n"
-                                "--123456789\r\n");
-                    SSL_write(ssl, req, strlen(req));
+    free(batch);
+    free(results);
+    smtp_message_free(message);
+    return NULL;
+}
 
-                    current = current->next;
-                }
+SMTPSpool* smtp_spool_open(const char *path, SMTPClient client, SMTPSpoolConfig config, SMTPCompletionCallback callback, void *userData)
+{
+    if (client.port != 465 && client.port != 587 && client.port != 2525)
+        return NULL;
 
-                sprintf(req,".\r\n");
-                SSL_write(ssl, req, strlen(req));
-                free(length);
-            }
+    SMTPSpool *spool = smtp_calloc(1, sizeof(SMTPSpool));
+    if (!spool)
+        return NULL;
 
-            strcpy(req, "QUIT\r\n");
-            SSL_write(ssl, req, strlen(req));
+    spool->client = client;
+    spool->config = config;
+    spool->callback = callback;
+    spool->userData = userData;
+    spool->nextId = 1;
 
-            if (enableLogs)
-            {
-                    printf("C: %s", req);
-                SSL_read(ssl, buffer, sizeof(buffer));
-                printf("S: %s", buffer);
-            }
+    if (spool->config.workers <= 0)
+        spool->config.workers = 1;
 
-            SSL_free(ssl);
-            SSL_CTX_free(ctx);
-            close(clientfd);
-        }
-        else {
-            if (client.authType == LOGIN)
-            {
-                strcpy(req, "AUTH LOGIN\r\n");
-                send(clientfd, req, strlen(req), 0);
-                if (enableLogs)
-                {
-                    printf("C: %s", req);
-                    recv(clientfd, buffer, sizeof(buffer), 0);
-                    printf("S: %s", buffer);
-                }
+    if (spool->config.batchSize <= 0)
+        spool->config.batchSize = 32;
 
-                base64_encode(req, client.emailAdress);
-                strcat(req, "\r\n");
-                send(clientfd, req, strlen(req), 0);
+    if (spool->config.maxAttempts <= 0)
+        spool->config.maxAttempts = 8;
 
-                if (enableLogs)
-                {
-                    printf("C: %s", req);
-                    recv(clientfd, buffer, sizeof(buffer), 0);
-                    printf("S: %s", buffer);
-                }
+    if (spool->config.initialBackoffSeconds <= 0)
+        spool->config.initialBackoffSeconds = 60;
 
-                base64_encode(req, client.secretCode);
-                strcat(req, "\r\n");
-                send(clientfd, req, strlen(req), 0);
+    if (spool->config.maxBackoffSeconds <= 0)
+        spool->config.maxBackoffSeconds = 3600;
 
-                if (enableLogs)
-                {
-                    printf("C: %s", req);
-                    recv(clientfd, buffer, sizeof(buffer), 0);
-                    printf("S: %s", buffer);
-                }
-            }
-            else
-            {
-                const char xoauth2_prefix[] = "AUTH XOAUTH2 ";
-                char temp[4069] = {0};
+    pthread_mutex_init(&spool->lock, NULL);
+    pthread_cond_init(&spool->synced, NULL);
 
-                snprintf(temp, sizeof(temp), "user=%s%cauth=Bearer %s\%c%c", client.emailAdress,  0x01, client.secretCode, 0x01, 0x01);
-                printf("%s\n", temp);
-                BIO *bio, *b64;
-                BUF_MEM *bufferPtr;
+    // Backoff deadlines are wall-clock times, since they survive restarts
+    pthread_cond_init(&spool->changed, NULL);
 
-                b64 = BIO_new(BIO_f_base64());
-                bio = BIO_new(BIO_s_mem());
-                bio = BIO_push(b64, bio);
+    spool->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
 
-                BIO_set_flags(bio, BIO_FLAGS_BASE64_NO_NL);
+    // Two processes draining one spool would send everything twice
+    if (spool->fd < 0 || flock(spool->fd, LOCK_EX | LOCK_NB) || spool_replay(spool))
+    {
+        smtp_spool_close(spool);
+        return NULL;
+    }
 
-                BIO_write(bio, temp, strlen(temp));
-                BIO_flush(bio);
+    spool->workers = smtp_calloc(spool->config.workers, sizeof(pthread_t));
+    if (!spool->workers)
+    {
+        smtp_spool_close(spool);
+        return NULL;
+    }
 
-                BIO_get_mem_ptr(bio, &bufferPtr);
-                memcpy(req, bufferPtr->data, bufferPtr->length);
-                req[bufferPtr->length] = '\0';
+    ignore_sigpipe();
 
-                BIO_free_all(bio);
-                printf("%s\n", req);
-                strcat(req, "\r\n");
-                sprintf(temp, "%s%s", xoauth2_prefix, req);
-                send(clientfd, temp, strlen(temp), 0);
+    for (; spool->workersStarted < spool->config.workers; spool->workersStarted++) {
+        if (pthread_create(&spool->workers[spool->workersStarted], NULL, spool_worker, spool))
+            break;
+    }
 
-                if (enableLogs)
-                {
-                    printf("C: %s", temp);
-                    recv(clientfd, buffer, sizeof(buffer), 0);
-                    printf("S: %s", buffer);
-                }
-            }
+    if (!spool->workersStarted)
+    {
+        smtp_spool_close(spool);
+        return NULL;
+    }
 
-            sprintf(req, "MAIL FROM: <%s>\r\n", client.emailAdress);
-            send(clientfd, req, strlen(req), 0);
+    return spool;
+}
 
-            if (enableLogs)
-            {
-                printf("C: %s", req);
-                recv(clientfd, buffer, sizeof(buffer), 0);
-                printf("S: %s", buffer);
-            }
+int smtp_spool_enqueue(SMTPSpool *spool, MailMessage *message)
+{
+    uint32_t length;
 
-            sprintf(req, "RCPT TO: <%s>\r\n", message.receiverEmailAdress);
-            send(clientfd, req, strlen(req), 0);
+    if (!message->recipientList.numberOfElements)
+        return -1;
 
-            if (enableLogs)
-            {
-                printf("C: %s", req);
-                recv(clientfd, buffer, sizeof(buffer), 0);
-                printf("S: %s", buffer);
-            }
+    char *payload = spool_serialize(message, &length);
+    if (!payload)
+        return -1;
 
-            strcpy(req, "DATA\r\n");
-            send(clientfd, req, strlen(req), 0);
+    SpoolEntry *entry = smtp_calloc(1, sizeof(SpoolEntry));
+    if (!entry)
+    {
+        free(payload);
+        return -1;
+    }
 
-            if (enableLogs)
-            {
-                printf("C: %s", req);
-                recv(clientfd, buffer, sizeof(buffer), 0);
-                printf("S: %s", buffer);
-            }
+    pthread_mutex_lock(&spool->lock);
 
-            if (!message.attachementList.numberOfElements)
-            {
-                sprintf(req,"Date: %s\r\n"
-                            "From: <%s>\r\n"
-                            "To: Recipient <%s>\r\n"
-                            "MIME-Version: 1.0\r\n"
-                            "Content-Type: text/%s; charset=\"ISO-8859-1\"\r\n"
-                            "Subject: %s\r\n\r\n"
-                            "%s\r\n.\r\n",
-                            dateStr,
-                            client.emailAdress,
-                            message.receiverEmailAdress,
-                            message.isBodyHtml? "html" : "plain",
-                            message.subject,
-                            message.body);
+    entry->id = spool->nextId++;
+    entry->length = length;
 
-                send(clientfd, req, strlen(req), 0);
-                if (enableLogs)
-                {
-                    printf("C: %s", req);
-                    recv(clientfd, buffer, sizeof(buffer), 0);
-                    printf("S: %s", buffer);
-                }
-            }
-            else
-            {
-                sprintf(req,"Date: %s\r\n"
-                            "From: <%s>\r\n"
-                            "To: Recipient <%s>\r\n"
-                            "MIME-Version: 1.0\r\n"
-                            "Content-Type: multipart/mixed; boundary=\"123456789\"\r\n"
-                            "Subject: %s\r\n\r\n"
-                            "--123456789\r\n"
-                            "Content-Type: text/%s; charset=\"ISO-8859-1\"\r\n"
-                            "Content-Transfer-Encoding: quoted-printable\r\n\r\n"
-                            "%s\r\n\r\n"
-                            "--123456789\r\n",
-                            dateStr,
-                            client.emailAdress,
-                            message.receiverEmailAdress,
-                            message.subject,
-                            message.isBodyHtml? "html" : "plain",
-                            message.body);
-                send(clientfd, req, strlen(req), 0);
+    if (spool_append(spool, SPOOL_RECORD_MESSAGE, entry->id, payload, length, &entry->offset))
+    {
+        pthread_mutex_unlock(&spool->lock);
+        free(payload);
+        free(entry);
+        return -1;
+    }
 
-                AttachementListNode* current = message.attachementList.head;
-                unsigned char *file;
-                size_t* length = malloc(sizeof(size_t));
+    free(payload);
 
-                unsigned char *encoded_file;
-                size_t encoded_length;
+    off_t end = spool->writtenOffset;
+    int ret = 0;
 
-                for (int i = 0; i < message.attachementList.numberOfElements; i++)
-                {
-                    sprintf(req,"Content-Disposition: attachment; filename=\"%s\"\r\n"
-                                "Content-Type: %s; name=\"%s\"\r\n"
-                                "Content-Transfer-Encoding: base64\r\n\r\n",
-                                (current->attachement).fileName,
-                                get_mime_type((current->attachement).fileName),
-                                (current->attachement).fileName
-                    );
+    // Listed right away; a worker may pick it up before the sync finished
+    spool_push(spool, entry);
+    spool->stats.enqueued++;
 
-                    size_t total_sent;
-                    send(clientfd, req, strlen(req), 0);
+    // smtp_spool_wait() sleeps on the same condition, so a signal could wake
+    // it instead of a worker
+    pthread_cond_broadcast(&spool->changed);
 
-                    file = read_file((current->attachement).filePath, length);
+    if (spool->config.syncPolicy != SPOOL_SYNC_NONE)
+        ret = spool_sync(spool, end);
 
-                    encoded_length = 4 * ceil((*length) / 3);
+    pthread_mutex_unlock(&spool->lock);
+    return ret;
+}
 
-                    encoded_file = malloc(encoded_length + 1);
+int smtp_spool_wait(SMTPSpool *spool, int timeoutMs)
+{
+    struct timespec deadline;
 
-                    base64_encode_file(encoded_file, file, *length);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (timeoutMs % 1000) * 1000000L;
 
-                    free(file);
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
 
-                    total_sent = 0;
-                    while (total_sent < encoded_length) {
-                        int chunk = (encoded_length - total_sent > 16384)
-                                    ? 16384
-                                    : encoded_length - total_sent;
+    pthread_mutex_lock(&spool->lock);
 
-                        int ret = send(clientfd, encoded_file + total_sent, chunk, 0);
-                        total_sent += ret;
-                    }
+    while (spool->stats.pending > 0)
+    {
+        if (pthread_cond_timedwait(&spool->changed, &spool->lock, &deadline) == ETIMEDOUT)
+            break;
+    }
 
-                    free(encoded_file);
+    int pending = spool->stats.pending;
+    pthread_mutex_unlock(&spool->lock);
+    return pending;
+}
 
-                    sprintf(req,"\r\n\r\n"
-                                "--123456789\r\n");
-                    send(clientfd, req, strlen(req), 0);
+void smtp_spool_get_stats(SMTPSpool *spool, SMTPSpoolStats *stats)
+{
+    pthread_mutex_lock(&spool->lock);
+    *stats = spool->stats;
+    pthread_mutex_unlock(&spool->lock);
+}
 
-                    current = current->next;
-                }
+// Workers finish the batch they are sending; whatever is left stays in the
+// file for the next smtp_spool_open()
+void smtp_spool_close(SMTPSpool *spool)
+{
+    if (!spool)
+        return;
 
-                sprintf(req,".\r\n");
-                send(clientfd, req, strlen(req), 0);
+    pthread_mutex_lock(&spool->lock);
+    spool->stopping = 1;
+    pthread_cond_broadcast(&spool->changed);
+    pthread_mutex_unlock(&spool->lock);
 
-                free(length);
-            }
+    for (int i = 0; i < spool->workersStarted; i++)
+        pthread_join(spool->workers[i], NULL);
 
-            strcpy(req, "QUIT\r\n");
-            send(clientfd, req, strlen(req), 0);
+    if (spool->fd >= 0)
+    {
+        if (spool->config.syncPolicy != SPOOL_SYNC_NONE)
+            fdatasync(spool->fd);
 
-            if (enableLogs)
-            {
-                printf("C: %s", req);
-                recv(clientfd, buffer, sizeof(buffer), 0);
-                printf("S: %s", buffer);
-            }
-        }
+        close(spool->fd);
     }
-    else
+
+    while (spool->head)
     {
-        perror("Unknown smtp port\n");
-        exit(1);
+        SpoolEntry *next = spool->head->next;
+        free(spool->head);
+        spool->head = next;
     }
+
+    pthread_cond_destroy(&spool->changed);
+    pthread_cond_destroy(&spool->synced);
+    pthread_mutex_destroy(&spool->lock);
+    free(spool->workers);
+    free(spool);
 }
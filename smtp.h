@@ -1,6 +1,8 @@
 #ifndef SMTP
 #define SMTP
 
+#include <stddef.h>
+
 typedef enum AuthType
 {
     LOGIN,
@@ -18,11 +20,19 @@ struct SMTPClient
     AuthType authType;
 };
 
+// A string owned by a message. data is NUL-terminated; length excludes the NUL.
+typedef struct SMTPString SMTPString;
+struct SMTPString
+{
+    const char *data;
+    size_t length;
+};
+
 typedef struct Attachement Attachement;
 struct Attachement
 {
-    char fileName[1024];
-    char filePath[1024];
+    SMTPString fileName;
+    SMTPString filePath;
 };
 
 typedef struct AttachementListNode AttachementListNode;
@@ -39,17 +49,415 @@ struct AttachementList
     int numberOfElements;
 };
 
+typedef enum RecipientType
+{
+    RECIPIENT_TO,
+    RECIPIENT_CC,
+    RECIPIENT_BCC
+} RecipientType;
+
+typedef struct Recipient Recipient;
+struct Recipient
+{
+    SMTPString emailAdress;
+    RecipientType type;
+    int status;     // reply code the server gave to RCPT TO, 0 if not sent
+};
+
+typedef struct RecipientListNode RecipientListNode;
+struct RecipientListNode
+{
+    Recipient recipient;
+    RecipientListNode* next;
+};
+
+typedef struct RecipientList RecipientList;
+struct RecipientList
+{
+    RecipientListNode* head;
+    RecipientListNode* tail;
+    int numberOfElements;
+};
+
+typedef struct SMTPArena SMTPArena;
+
+// Messages are built with the smtp_message_* functions below, which copy
+// every string into the message's arena; the fields may be read but not
+// assigned. Everything is released at once by smtp_message_free().
 typedef struct MailMessage MailMessage;
 struct MailMessage
 {
-    char receiverEmailAdress[1024];
-    char subject[1024];
-    char body[1024];
+    SMTPString subject;
+    SMTPString body;
     int isBodyHtml;
     AttachementList attachementList;
+    RecipientList recipientList;
+    SMTPArena *arena;
+};
+
+typedef struct SMTPSession SMTPSession;
+
+// A parsed server reply. The text of all lines is joined with '\n', without
+// the codes, and cut short when it does not fit.
+typedef struct SMTPReply SMTPReply;
+struct SMTPReply
+{
+    int code;
+    int lines;
+    char text[512];
+    size_t textLength;
+};
+
+// The setters return 0, or -1 when memory runs out or the value cannot be
+// sent: a subject longer than a header line allows (998 octets with its
+// name), an address longer than 254 octets or a file name longer than 255.
+// The body may be of any length.
+// smtp_message_reset() empties a message for the next one and keeps its
+// memory, so a message reused this way stops allocating once warmed up.
+MailMessage* smtp_message_create(void);
+int smtp_message_set_subject(MailMessage *message, const char *subject);
+int smtp_message_set_body(MailMessage *message, const char *body, size_t length, int isBodyHtml);
+int smtp_message_add_recipient(MailMessage *message, const char *emailAdress, RecipientType type);
+int smtp_message_add_attachment(MailMessage *message, const char *fileName, const char *filePath);
+void smtp_message_reset(MailMessage *message);
+void smtp_message_free(MailMessage *message);
+
+void send_email(SMTPClient client, MailMessage *message, int enableLogs);
+
+// Persistent sessions keep one authenticated connection open across many
+// messages. smtp_session_send() returns 0 once the server accepted the message
+// for at least one recipient, leaving each recipient's RCPT TO reply code in
+// its status field. A session idle for 30 seconds is probed with NOOP before
+// the next message and one idle for five minutes reconnects, as does one the
+// server dropped. smtp_session_noop() keeps an idle session alive (or revives
+// a dead one).
+SMTPSession* smtp_session_open(SMTPClient client, int enableLogs);
+int smtp_session_send(SMTPSession *session, MailMessage *message);
+int smtp_session_noop(SMTPSession *session);
+void smtp_session_close(SMTPSession *session);
+
+// The last complete reply the server sent, e.g. to report why a send failed
+void smtp_session_get_last_reply(SMTPSession *session, SMTPReply *reply);
+
+// Carries a session over a connection the application provides, such as a
+// proxy tunnel or an in-memory server in tests. read and write return the
+// number of bytes moved (blocking until at least one), 0 on end of stream or
+// -1 on error; close is called once when the session is done with it. The
+// transport must already be encrypted if that is wanted, since STARTTLS is
+// not used. Such a session cannot reconnect on its own.
+typedef struct SMTPTransport SMTPTransport;
+struct SMTPTransport
+{
+    long (*read)(void *context, void *buffer, size_t length);
+    long (*write)(void *context, const void *buffer, size_t length);
+    void (*close)(void *context);
+    void *context;
+};
+
+SMTPSession* smtp_session_open_transport(SMTPClient client, SMTPTransport transport, int enableLogs);
+
+typedef struct SMTPRenderedMessage SMTPRenderedMessage;
+
+// Renders the subject, body and attachments of a message once, encoded for
+// any server, so the same content can go to many recipients or sessions
+// without being read and encoded again. The result does not depend on the
+// message, which may be reset or freed afterwards, and is never changed by
+// sending, so several threads may send it at once.
+// smtp_session_send_rendered() writes the Date, From, To, Cc and Message-ID
+// headers fresh for each send and the rendered part behind them. Only the
+// recipient list of envelope is used; their status fields are filled in as
+// with smtp_session_send().
+SMTPRenderedMessage* smtp_message_render(MailMessage *message);
+int smtp_session_send_rendered(SMTPSession *session, SMTPRenderedMessage *rendered, MailMessage *envelope);
+void smtp_rendered_message_free(SMTPRenderedMessage *rendered);
+
+typedef struct SMTPPool SMTPPool;
+
+typedef struct SMTPPoolStats SMTPPoolStats;
+struct SMTPPoolStats
+{
+    unsigned long acquisitions;
+    unsigned long hits;         // served from an idle session
+    unsigned long misses;       // had to open a new connection
+    unsigned long waits;        // had to queue because the server was at its limit
+    unsigned long failures;     // could not connect or authenticate
+    double totalWaitSeconds;
+    double maxWaitSeconds;
+    int openConnections;
+    int idleConnections;
+};
+
+// A pool hands out authenticated sessions shared by many threads, keyed by
+// (mailServer, port, emailAdress). At most maxConnectionsPerServer sessions
+// exist per key; smtp_pool_acquire() blocks until one is free when the limit
+// is reached. Every acquired session must be handed back with
+// smtp_pool_release().
+SMTPPool* smtp_pool_create(int maxConnectionsPerServer, int enableLogs);
+SMTPSession* smtp_pool_acquire(SMTPPool *pool, SMTPClient client);
+void smtp_pool_release(SMTPPool *pool, SMTPSession *session);
+int smtp_pool_send(SMTPPool *pool, SMTPClient client, MailMessage *message);
+void smtp_pool_get_stats(SMTPPool *pool, SMTPPoolStats *stats);
+void smtp_pool_destroy(SMTPPool *pool);
+
+typedef struct SMTPEngine SMTPEngine;
+
+// Called from smtp_engine_run() when a message finished; result is 0 when the
+// server accepted it, -1 otherwise. Recipient status fields are filled in.
+typedef void (*SMTPCompletionCallback)(MailMessage *message, int result, void *userData);
+
+// The engine drives many transactions from one thread over non-blocking
+// sockets and epoll, one connection per submitted message. Call
+// smtp_engine_run() in a loop; it waits up to timeoutMs for socket events,
+// advances every ready connection and returns the number of messages still in
+// flight. The message must stay valid until its callback ran.
+SMTPEngine* smtp_engine_create(int enableLogs);
+
+typedef enum SMTPEngineBackend
+{
+    SMTP_ENGINE_EPOLL,
+    SMTP_ENGINE_IO_URING
+} SMTPEngineBackend;
+
+// With SMTP_ENGINE_IO_URING sends and receives are queued on an io_uring and
+// each smtp_engine_run() hands them to the kernel and collects what finished
+// in a single system call. Needs Linux 5.11 or later; elsewhere the engine
+// uses epoll, which smtp_engine_get_backend() tells.
+SMTPEngine* smtp_engine_create_backend(int enableLogs, SMTPEngineBackend backend);
+SMTPEngineBackend smtp_engine_get_backend(SMTPEngine *engine);
+int smtp_engine_submit(SMTPEngine *engine, SMTPClient client, MailMessage *message, SMTPCompletionCallback callback, void *userData);
+int smtp_engine_run(SMTPEngine *engine, int timeoutMs);
+void smtp_engine_destroy(SMTPEngine *engine);
+
+typedef struct SMTPSpool SMTPSpool;
+
+typedef enum SpoolSyncPolicy
+{
+    SPOOL_SYNC_EACH,        // every enqueue waits for its own fdatasync
+    SPOOL_SYNC_GROUP,       // concurrent enqueues share one fdatasync
+    SPOOL_SYNC_NONE         // left to the kernel; a crash may lose recent messages
+} SpoolSyncPolicy;
+
+// Fields left at 0 take the default shown
+typedef struct SMTPSpoolConfig SMTPSpoolConfig;
+struct SMTPSpoolConfig
+{
+    SpoolSyncPolicy syncPolicy;
+    int groupCommitMicroseconds;    // SPOOL_SYNC_GROUP: extra wait for more writers to join (0)
+    int workers;                    // delivery threads, one connection each (1)
+    int batchSize;                  // messages a worker takes at once (32)
+    int maxAttempts;                // before a message fails for good (8)
+    int initialBackoffSeconds;      // doubled after every failed attempt (60)
+    int maxBackoffSeconds;          // (3600)
+    int enableLogs;
+};
+
+typedef struct SMTPSpoolStats SMTPSpoolStats;
+struct SMTPSpoolStats
+{
+    unsigned long enqueued;
+    unsigned long delivered;
+    unsigned long failed;       // rejected with a 5xx reply or out of attempts
+    unsigned long deferred;     // attempts that will be retried later
+    unsigned long syncs;
+    unsigned long writeErrors;  // outcomes not recorded, sent again after reopening
+    int pending;                // in the spool, including messages being sent
 };
 
-void send_email(SMTPClient client, MailMessage message, int enableLogs);
-void insert_attachement(MailMessage *message, Attachement attachement);
+// A spool is a durable outbound queue for one relay. smtp_spool_enqueue()
+// appends a copy of the message to an append-only file and returns once it
+// is stored as the sync policy demands; background workers drain the spool
+// in batches over reused connections, retrying 4xx replies and lost
+// connections with exponential backoff. Messages still in the file when the process stops are
+// sent after the next smtp_spool_open() of the same path. Attachment files
+// are referenced by path and must stay in place until the message is sent.
+// The callback runs on a worker thread once a message was delivered (0) or
+// given up on (-1), with recipient status fields filled in.
+// smtp_spool_wait() blocks until the spool is empty or timeoutMs passed and
+// returns the number of messages still pending.
+SMTPSpool* smtp_spool_open(const char *path, SMTPClient client, SMTPSpoolConfig config, SMTPCompletionCallback callback, void *userData);
+int smtp_spool_enqueue(SMTPSpool *spool, MailMessage *message);
+int smtp_spool_wait(SMTPSpool *spool, int timeoutMs);
+void smtp_spool_get_stats(SMTPSpool *spool, SMTPSpoolStats *stats);
+void smtp_spool_close(SMTPSpool *spool);
+
+typedef struct SMTPTLSStats SMTPTLSStats;
+struct SMTPTLSStats
+{
+    unsigned long fullHandshakes;
+    unsigned long resumedHandshakes;   // reused a session ticket from an earlier connection
+};
+
+// Sessions, pools and engines share one TLS context and remember the last
+// session each server issued, so later connections to the same server and
+// port resume it. The counters cover every handshake in the process.
+void smtp_tls_get_stats(SMTPTLSStats *stats);
+
+typedef struct SMTPAttachmentCacheStats SMTPAttachmentCacheStats;
+struct SMTPAttachmentCacheStats
+{
+    unsigned long hits;
+    unsigned long misses;
+    int entries;
+    size_t bytes;       // encoded bytes currently held
+    int fileEntries;
+    size_t fileBytes;   // encoded bytes held in files for sendfile()
+    unsigned long sendfileBytes;
+};
+
+// Keeps the base64-encoded form of attachments in memory so sending the same
+// file again skips reading and encoding it. Files are matched on path, size
+// and modification time. maxBytes bounds the encoded bytes kept, least
+// recently used files go first; 0 (the default) turns the cache off.
+void smtp_attachment_cache_configure(size_t maxBytes);
+void smtp_attachment_cache_get_stats(SMTPAttachmentCacheStats *stats);
+
+// Attachments whose encoding does not fit the memory cache are encoded once
+// into unlinked files in directory and sent from there with sendfile(),
+// straight from the page cache: on plain connections always, and over TLS
+// when the kernel and OpenSSL provide kernel TLS, which this also asks for.
+// Elsewhere, and on the engine and application transports, the files are read
+// back instead, which still skips the encoding. maxBytes bounds the encoded
+// bytes kept on disk, least recently used files go first; a NULL directory or
+// 0 (the default) turns this off. Returns -1 when directory cannot hold files.
+int smtp_attachment_sendfile_configure(const char *directory, size_t maxBytes);
+
+// Attachments get their Content-Type from the extension of their file name,
+// matched case-insensitively. smtp_mime_type_register() adds an extension
+// ("log" or ".log") or overrides a built-in one; it returns -1 when the
+// extension is empty, contains a dot or is longer than 30 characters.
+// With sniffing on, a file whose extension is unknown is recognised by its
+// first bytes when it is a common binary format (PDF, images, audio, video,
+// archives, fonts); otherwise it stays application/octet-stream.
+int smtp_mime_type_register(const char *extension, const char *mimeType);
+void smtp_mime_sniffing_configure(int enable);
+
+typedef struct SMTPAttachmentEncoderStats SMTPAttachmentEncoderStats;
+struct SMTPAttachmentEncoderStats
+{
+    unsigned long encoded;      // attachments encoded ahead by the threads
+    unsigned long failed;       // could not be read or stored ahead, left to the sender
+    unsigned long inlined;      // still queued when needed, so encoded by the sender
+    unsigned long waits;        // the sender waited for an encoding in progress
+    size_t bytes;               // encoded bytes reserved for queued or unsent attachments
+};
+
+// Encodes upcoming base64 attachments of a message on a pool of threads while
+// the sender writes what comes before them, instead of reading and encoding
+// each one on the sending thread between network writes. Attachments still go
+// out in order. maxBytes bounds the encoded bytes held ahead by all senders
+// together; an attachment that would not fit is encoded by its sender as
+// before. threads or maxBytes of 0 (the default) turns it off. Returns -1
+// when not all threads could be started.
+int smtp_attachment_encoder_configure(int threads, size_t maxBytes);
+void smtp_attachment_encoder_get_stats(SMTPAttachmentEncoderStats *stats);
+
+typedef struct SMTPMemoryStats SMTPMemoryStats;
+struct SMTPMemoryStats
+{
+    unsigned long allocations;      // heap allocations made by the library
+    unsigned long bytes;            // requested by them in total
+};
+
+// Counts since the process started; allocations inside OpenSSL and the C
+// library (name resolution) are not included. Sending over an open session,
+// and once warmed up through the engine and the spool, allocates nothing.
+void smtp_memory_get_stats(SMTPMemoryStats *stats);
+
+typedef enum SMTPPhase
+{
+    SMTP_PHASE_DNS,
+    SMTP_PHASE_CONNECT,         // TCP connect
+    SMTP_PHASE_TLS,             // TLS handshake, implicit or after STARTTLS
+    SMTP_PHASE_GREETING,        // waiting for the server's 220
+    SMTP_PHASE_EHLO,
+    SMTP_PHASE_AUTH,
+    SMTP_PHASE_ENVELOPE,        // MAIL FROM and RCPT TO up to DATA or the first BDAT
+    SMTP_PHASE_ATTACHMENT,      // opening and mapping a file, or taking it from the cache
+    SMTP_PHASE_ENCODE,          // base64, bytes counted before encoding
+    SMTP_PHASE_UPLOAD,          // writing the message content
+    SMTP_PHASE_FINAL_REPLY,     // from the end of the content to the server's reply
+    SMTP_PHASE_COUNT
+} SMTPPhase;
+
+// Bucket i counts durations up to 2^i microseconds; the last one (about 4.2
+// seconds and up) everything longer
+#define SMTP_METRICS_BUCKETS 24
+
+typedef struct SMTPPhaseStats SMTPPhaseStats;
+struct SMTPPhaseStats
+{
+    unsigned long count;
+    unsigned long totalMicroseconds;
+    unsigned long bytes;
+    unsigned long buckets[SMTP_METRICS_BUCKETS];
+};
+
+typedef void (*SMTPMetricsCallback)(SMTPPhase phase, unsigned long microseconds, unsigned long bytes, void *userData);
+
+// Records how long every phase of every transaction takes, in process-wide
+// histograms. Off by default, when it costs next to nothing. Phases nest:
+// encoding and reading attachments happen during the upload. The callback,
+// if set, runs on the sending thread for each sample; set it before enabling.
+// smtp_metrics_format() writes all histograms in the Prometheus text format
+// and, like snprintf, returns the length the whole text needs.
+void smtp_metrics_enable(int enable);
+void smtp_metrics_set_callback(SMTPMetricsCallback callback, void *userData);
+void smtp_metrics_get(SMTPPhase phase, SMTPPhaseStats *stats);
+size_t smtp_metrics_format(char *dest, size_t capacity);
+void smtp_metrics_reset(void);
+
+typedef enum SMTPLogLevel
+{
+    SMTP_LOG_ERROR,
+    SMTP_LOG_WARNING,
+    SMTP_LOG_INFO,              // spool retries
+    SMTP_LOG_DEBUG              // protocol traffic of sessions with enableLogs set
+} SMTPLogLevel;
+
+typedef enum SMTPLogSource
+{
+    SMTP_LOG_CLIENT,            // lines sent to the server
+    SMTP_LOG_SERVER,            // lines received from it
+    SMTP_LOG_SPOOL
+} SMTPLogSource;
+
+typedef struct SMTPLogRecord SMTPLogRecord;
+struct SMTPLogRecord
+{
+    SMTPLogLevel level;
+    SMTPLogSource source;
+    long long timeMicroseconds;     // since the epoch
+    const char *text;               // NUL-terminated, protocol lines keep their CRLF
+    size_t length;
+    size_t originalLength;          // before truncation
+};
+
+typedef void (*SMTPLogHandler)(const SMTPLogRecord *record, void *userData);
+
+typedef struct SMTPLogStats SMTPLogStats;
+struct SMTPLogStats
+{
+    unsigned long logged;
+    unsigned long dropped;          // the ring was full
+};
+
+// Records are copied into a lock-free ring and handed to the handler by a
+// background thread, so tracing never blocks a sending thread; when the ring
+// is full records are dropped rather than waited for. Records above level are
+// discarded before they are copied. Texts longer than maxPayload bytes are
+// truncated (0 keeps the default of 256, the most is 495). Credentials in AUTH
+// commands are always replaced by "[redacted]". A NULL handler writes to
+// stdout in the "C: " / "S: " form. smtp_log_flush() returns once everything
+// logged so far has been handled; it also runs at exit.
+void smtp_log_configure(SMTPLogLevel level, size_t maxPayload, SMTPLogHandler handler, void *userData);
+void smtp_log_flush(void);
+void smtp_log_get_stats(SMTPLogStats *stats);
+
+// Base64-encodes srcLength bytes into dest and returns the number of bytes
+// written. With lineWrap set the output is split into CRLF-terminated lines
+// of 76 characters (RFC 2045). dest must have room for
+// smtp_base64_encoded_length(srcLength, lineWrap) bytes; no NUL is appended.
+size_t smtp_base64_encode(char *dest, const unsigned char *src, size_t srcLength, int lineWrap);
+size_t smtp_base64_encoded_length(size_t srcLength, int lineWrap);
 
 #endif